@@ -0,0 +1,169 @@
+/**
+ * @file aesd-alloc.c
+ * @brief Size classed slab caches for aesdchar entry payloads
+ *
+ * Every write allocates a payload and every eviction frees one, dedicated
+ * caches keep that churn off the shared kmalloc() caches and make it visible.
+ */
+
+#include <linux/slab.h>
+#include <linux/log2.h>
+#include <linux/atomic.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include "aesd-alloc.h"
+
+struct aesd_alloc_class
+{
+    struct kmem_cache *cache; /* NULL for the kmalloc() fallback */
+    size_t size;
+    char name[16];
+    atomic_long_t allocs;
+    atomic_long_t frees;
+    atomic_long_t failures;
+};
+
+/* One per size class plus the kmalloc() fallback as the last one */
+static struct aesd_alloc_class aesd_alloc_classes[AESD_ALLOC_CLASSES + 1];
+
+/*
+** Returns: the class capacity bytes are served from
+*/
+static struct aesd_alloc_class *aesd_alloc_class_for(size_t capacity)
+{
+    if (capacity > (1UL << AESD_ALLOC_MAX_SHIFT))
+    {
+        return &aesd_alloc_classes[AESD_ALLOC_CLASSES];
+    }
+
+    if (capacity <= (1UL << AESD_ALLOC_MIN_SHIFT))
+    {
+        return &aesd_alloc_classes[0];
+    }
+
+    return &aesd_alloc_classes[order_base_2(capacity) - AESD_ALLOC_MIN_SHIFT];
+}
+
+/*
+** Allocates a payload buffer of at least size bytes.
+** Returns: the buffer, or NULL with *capacity untouched on failure.
+** *capacity receives the usable size, pass it back to aesd_payload_free().
+*/
+char *aesd_payload_alloc(size_t size, size_t *capacity)
+{
+    struct aesd_alloc_class *class = aesd_alloc_class_for(size);
+    char *buffptr;
+
+    if (class->cache != NULL)
+    {
+        buffptr = kmem_cache_alloc(class->cache, GFP_KERNEL);
+        size = class->size;
+    }
+    else
+    {
+        buffptr = kmalloc(size, GFP_KERNEL);
+    }
+
+    if (!buffptr)
+    {
+        atomic_long_inc(&class->failures);
+        return NULL;
+    }
+
+    atomic_long_inc(&class->allocs);
+    *capacity = size;
+    return buffptr;
+}
+
+/*
+** Frees a buffer from aesd_payload_alloc(), NULL is ignored
+*/
+void aesd_payload_free(const char *buffptr, size_t capacity)
+{
+    struct aesd_alloc_class *class;
+
+    if (buffptr == NULL)
+    {
+        return;
+    }
+
+    class = aesd_alloc_class_for(capacity);
+    if (class->cache != NULL)
+    {
+        kmem_cache_free(class->cache, (void *)buffptr);
+    }
+    else
+    {
+        kfree(buffptr);
+    }
+
+    atomic_long_inc(&class->frees);
+}
+
+static int aesd_alloc_stats_show(struct seq_file *s, void *unused)
+{
+    uint32_t index;
+    struct aesd_alloc_class *class;
+    long allocs, frees;
+
+    seq_printf(s, "%-16s %12s %12s %12s %10s\n", "class", "allocs", "frees", "live", "failures");
+    for (index = 0; index <= AESD_ALLOC_CLASSES; index++)
+    {
+        class = &aesd_alloc_classes[index];
+        allocs = atomic_long_read(&class->allocs);
+        frees = atomic_long_read(&class->frees);
+        seq_printf(s, "%-16s %12ld %12ld %12ld %10ld\n", class->name, allocs, frees,
+                allocs - frees, atomic_long_read(&class->failures));
+    }
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(aesd_alloc_stats);
+
+/*
+** Creates the size class caches and the alloc_stats file in debugfs_dir,
+** which may be an error pointer when debugfs is unavailable.
+** Returns: 0 on success, -ENOMEM with no cache left behind otherwise.
+*/
+int aesd_alloc_init(struct dentry *debugfs_dir)
+{
+    uint32_t index;
+    struct aesd_alloc_class *class;
+
+    for (index = 0; index < AESD_ALLOC_CLASSES; index++)
+    {
+        class = &aesd_alloc_classes[index];
+        class->size = 1UL << (AESD_ALLOC_MIN_SHIFT + index);
+        snprintf(class->name, sizeof(class->name), "aesdchar-%zu", class->size);
+
+        /* Payloads are copied to and from user space, whitelist all of it */
+        class->cache = kmem_cache_create_usercopy(class->name, class->size, 0, 0,
+                0, class->size, NULL);
+        if (!class->cache)
+        {
+            aesd_alloc_exit();
+            return -ENOMEM;
+        }
+    }
+
+    snprintf(aesd_alloc_classes[AESD_ALLOC_CLASSES].name,
+            sizeof(aesd_alloc_classes[AESD_ALLOC_CLASSES].name), "kmalloc");
+
+    debugfs_create_file("alloc_stats", 0444, debugfs_dir, NULL, &aesd_alloc_stats_fops);
+    return 0;
+}
+
+/*
+** Destroys the caches, every payload must already be freed.
+** The debugfs file goes away with its directory.
+*/
+void aesd_alloc_exit(void)
+{
+    uint32_t index;
+
+    for (index = 0; index < AESD_ALLOC_CLASSES; index++)
+    {
+        kmem_cache_destroy(aesd_alloc_classes[index].cache);
+        aesd_alloc_classes[index].cache = NULL;
+    }
+}
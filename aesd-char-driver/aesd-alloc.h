@@ -0,0 +1,35 @@
+/*
+ * aesd-alloc.h
+ *
+ *  @brief Payload buffer allocation for the aesdchar driver
+ *
+ *  Entry payloads come from a set of power of two slab caches, one per size
+ *  class, instead of the general purpose kmalloc() caches. Payloads above the
+ *  largest class fall back to kmalloc(). Counters are shown in
+ *  <debugfs>/aesdchar/alloc_stats.
+ */
+
+#ifndef AESD_ALLOC_H
+#define AESD_ALLOC_H
+
+#include <linux/types.h>
+
+struct dentry;
+
+/**
+ * Smallest and largest size class, payloads are rounded up to a power of two
+ * in between
+ */
+#define AESD_ALLOC_MIN_SHIFT 5
+#define AESD_ALLOC_MAX_SHIFT 12
+#define AESD_ALLOC_CLASSES   (AESD_ALLOC_MAX_SHIFT - AESD_ALLOC_MIN_SHIFT + 1)
+
+extern int aesd_alloc_init(struct dentry *debugfs_dir);
+
+extern void aesd_alloc_exit(void);
+
+extern char *aesd_payload_alloc(size_t size, size_t *capacity);
+
+extern void aesd_payload_free(const char *buffptr, size_t capacity);
+
+#endif /* AESD_ALLOC_H */
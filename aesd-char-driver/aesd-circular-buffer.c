@@ -10,14 +10,60 @@
 
 #ifdef __KERNEL__
 #include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/mm.h> /* kvcalloc */
+/* Up to AESDCHAR_MAX_ENTRIES_LIMIT entries is tens of MB, falls back to vmalloc */
+#define AESD_ENTRIES_ALLOC(n) kvcalloc(n, sizeof(struct aesd_buffer_entry), GFP_KERNEL)
+#define AESD_ENTRIES_FREE(p) kvfree(p)
 #else
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#define AESD_ENTRIES_ALLOC(n) calloc(n, sizeof(struct aesd_buffer_entry))
+#define AESD_ENTRIES_FREE(p) free(p)
 #endif
 
 #include "aesd-circular-buffer.h"
 
+/**
+* @return the number of entries of @param buffer holding data, complete ones plus
+* the partial entry at in_offs (if any)
+*/
+uint32_t aesd_circular_buffer_used(struct aesd_circular_buffer *buffer)
+{
+    uint32_t used = aesd_circular_buffer_count(buffer);
+
+    if ((!buffer->full) && (buffer->entry[buffer->in_offs].buffptr != NULL))
+    {
+        used++;
+    }
+
+    return used;
+}
+
+/**
+* @return the entry @param index positions after the oldest one
+*/
+static struct aesd_buffer_entry *aesd_circular_buffer_nth(struct aesd_circular_buffer *buffer, uint32_t index)
+{
+    return &buffer->entry[(buffer->out_offs + index) % buffer->capacity];
+}
+
+/**
+* Points base_pos at the oldest entry holding data, end_pos when the buffer is empty
+*/
+static void aesd_circular_buffer_update_base(struct aesd_circular_buffer *buffer)
+{
+    if (buffer->entry[buffer->out_offs].buffptr != NULL)
+    {
+        buffer->base_pos = buffer->entry[buffer->out_offs].start;
+    }
+    else
+    {
+        buffer->base_pos = buffer->end_pos;
+    }
+}
+
 /**
  * @param buffer the buffer to search for corresponding offset.  Any necessary locking must be performed by caller.
  * @param char_offset the position to search for in the buffer list, describing the zero referenced
@@ -27,82 +73,65 @@
  *      in aesd_buffer.
  * @return the struct aesd_buffer_entry structure representing the position described by char_offset, or
  * NULL if this position is not available in the buffer (not enough data is written).
+ *
+ * Entries are contiguous in stream positions, so this is a binary search over their start offsets.
  */
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn )
 {
     struct aesd_buffer_entry *entry = NULL;
+    uint32_t low = 0;
+    uint32_t high = aesd_circular_buffer_used(buffer);
+    uint32_t middle;
 
-    size_t buf_index = buffer->out_offs;
-    size_t cnt = 0;
-    size_t bytecnt = 0;
-    while (cnt < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
-    {   
-        /* Check whether we need to roll-over */
-        if (buf_index >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+    if ((high == 0) || (char_offset >= (buffer->end_pos - buffer->base_pos)))
+    {
+        return NULL;
+    }
+
+    /* Last entry starting at or before char_offset */
+    while ((high - low) > 1)
+    {
+        middle = low + ((high - low) / 2);
+        if ((aesd_circular_buffer_nth(buffer, middle)->start - buffer->base_pos) <= char_offset)
         {
-            buf_index = 0;
+            low = middle;
         }
-
-        /* Check if we are on requested entry */
-        if ((bytecnt + buffer->entry[buf_index].size) > char_offset)
+        else
         {
-            entry = &buffer->entry[buf_index];
-            *entry_offset_byte_rtn = (char_offset - bytecnt);
-            break;
+            high = middle;
         }
-
-        bytecnt += buffer->entry[buf_index].size;
-        cnt++;
-        buf_index++;
     }
 
+    entry = aesd_circular_buffer_nth(buffer, low);
+    *entry_offset_byte_rtn = char_offset - (entry->start - buffer->base_pos);
     return entry;
 }
 
+/**
+ * @param buffer the buffer to search.  Any necessary locking must be performed by caller.
+ * @param write_cmd the zero referenced entry, counted from the oldest one
+ * @param write_cmd_offset the zero referenced offset within that entry
+ * @return the character offset of write_cmd_offset within the concatenated entries, or -1
+ * if the entry or the offset within it does not exist
+ */
 long aesd_buffer_find_offset(struct aesd_circular_buffer *buffer, uint32_t write_cmd, uint32_t write_cmd_offset)
 {
-    size_t buf_index = buffer->out_offs;
-    size_t cnt = 0;
-    long offset = 0;
+    struct aesd_buffer_entry *entry;
 
-    while (cnt < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+    if (write_cmd >= aesd_circular_buffer_used(buffer))
     {
-        /* Check whether we need to roll-over */
-        if (buf_index >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
-        {
-            buf_index = 0;
-        }
-
-        /* Check if we are on requested entry */
-        if (buf_index == write_cmd)
-        {
-            if (write_cmd_offset >= buffer->entry[buf_index].size)
-            {
-                /* Error: incorrect entry offset requested */
-                offset = -1;
-            }
-            else
-            {
-                offset += write_cmd_offset;
-            }
-
-            break;
-        }
-
-        /* Check if we are on requested entry */
-        if (buffer->entry[buf_index].size > 0 && write_cmd == cnt)
-        {
-            offset = write_cmd_offset;
-            break;
-        }
+        return -1;
+    }
 
-        offset += buffer->entry[buf_index].size;
-        cnt++;
-        buf_index++;
+    entry = aesd_circular_buffer_nth(buffer, write_cmd);
+    if (write_cmd_offset >= entry->size)
+    {
+        /* Error: incorrect entry offset requested */
+        return -1;
     }
 
-    return offset;
+    return (long)(entry->start - buffer->base_pos) + write_cmd_offset;
 }
 
 /**
@@ -120,14 +149,21 @@ aesd_circular_buffer_add_entry(
     Boolean new_entry
 )
 {
+    /* A new entry starts where the stream ends, a grown partial entry keeps its start */
+    size_t start = (new_entry == TRUE) ? buffer->end_pos : buffer->entry[buffer->in_offs].start;
+    uint64_t seq = (new_entry == TRUE) ? buffer->end_seq++ : buffer->entry[buffer->in_offs].seq;
+
     buffer->entry[buffer->in_offs] = *add_entry;
+    buffer->entry[buffer->in_offs].start = start;
+    buffer->entry[buffer->in_offs].seq = seq;
+    buffer->end_pos = start + add_entry->size;
     if (new_entry == TRUE)
     {
         /* Move read point if buffer is full */
         if (buffer->full == true)
         {
             buffer->out_offs++;
-            if (buffer->out_offs >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+            if (buffer->out_offs >= buffer->capacity)
             {
                 buffer->out_offs = 0;
             }
@@ -138,7 +174,7 @@ aesd_circular_buffer_add_entry(
     {
         /* Move write point to next location and hadle overrun */
         buffer->in_offs++;
-        if (buffer->in_offs >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+        if (buffer->in_offs >= buffer->capacity)
         {
             buffer->in_offs = 0;
         }
@@ -153,12 +189,116 @@ aesd_circular_buffer_add_entry(
             buffer->full = false;
         }
     }
+
+    aesd_circular_buffer_update_base(buffer);
 }
 
 /**
 * Initializes the circular buffer described by @param buffer to an empty struct
+* with room for @param capacity entries
+* @return 0 on success, -EINVAL or -ENOMEM on failure
 */
-void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
+int aesd_circular_buffer_init(struct aesd_circular_buffer *buffer, uint32_t capacity)
 {
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    if ((capacity == 0) || (capacity > AESDCHAR_MAX_ENTRIES_LIMIT))
+    {
+        return -EINVAL;
+    }
+
+    buffer->entry = AESD_ENTRIES_ALLOC(capacity);
+    if (buffer->entry == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    buffer->capacity = capacity;
+    return 0;
+}
+
+/**
+* Frees the entry array of @param buffer. Memory referenced by the entries
+* must be freed by the caller first.
+*/
+void aesd_circular_buffer_destroy(struct aesd_circular_buffer *buffer)
+{
+    AESD_ENTRIES_FREE(buffer->entry);
+    buffer->entry = NULL;
+    buffer->capacity = 0;
+}
+
+/**
+* @return the number of complete entries in @param buffer, the partial entry
+* at in_offs (if any) is not counted
+*/
+uint32_t aesd_circular_buffer_count(struct aesd_circular_buffer *buffer)
+{
+    if (buffer->full)
+    {
+        return buffer->capacity;
+    }
+
+    return (buffer->in_offs + buffer->capacity - buffer->out_offs) % buffer->capacity;
+}
+
+/**
+* Removes the oldest complete entry of @param buffer and copies it to @param removed,
+* the caller becomes responsible for the memory it references.
+* Any necessary locking must be handled by the caller
+* @return false if there is no complete entry to remove
+*/
+bool aesd_circular_buffer_remove_oldest(struct aesd_circular_buffer *buffer,
+                                        struct aesd_buffer_entry *removed)
+{
+    if (aesd_circular_buffer_count(buffer) == 0)
+    {
+        return false;
+    }
+
+    *removed = buffer->entry[buffer->out_offs];
+    memset(&buffer->entry[buffer->out_offs], 0, sizeof(struct aesd_buffer_entry));
+    buffer->out_offs = (buffer->out_offs + 1) % buffer->capacity;
+    buffer->full = false;
+    aesd_circular_buffer_update_base(buffer);
+    return true;
+}
+
+/**
+* Moves the entries of @param buffer, oldest first, to a new array of @param capacity entries.
+* The caller has to remove entries that do not fit first.
+* Any necessary locking must be handled by the caller
+* @return 0 on success, -EINVAL if the entries do not fit, -ENOMEM
+*/
+int aesd_circular_buffer_resize(struct aesd_circular_buffer *buffer, uint32_t capacity)
+{
+    struct aesd_buffer_entry *entries;
+    uint32_t complete = aesd_circular_buffer_count(buffer);
+    /* A partial entry (no newline yet) always sits at in_offs */
+    bool partial = (!buffer->full) && (buffer->entry[buffer->in_offs].buffptr != NULL);
+    uint32_t used = complete + (partial ? 1 : 0);
+    uint32_t index;
+
+    if ((capacity == 0) || (capacity > AESDCHAR_MAX_ENTRIES_LIMIT) || (used > capacity))
+    {
+        return -EINVAL;
+    }
+
+    entries = AESD_ENTRIES_ALLOC(capacity);
+    if (entries == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    for (index = 0; index < used; index++)
+    {
+        entries[index] = buffer->entry[(buffer->out_offs + index) % buffer->capacity];
+    }
+
+    AESD_ENTRIES_FREE(buffer->entry);
+    buffer->entry = entries;
+    buffer->capacity = capacity;
+    buffer->out_offs = 0;
+    buffer->in_offs = complete % capacity;
+    buffer->full = (complete == capacity);
+    return 0;
 }
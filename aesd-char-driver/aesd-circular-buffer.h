@@ -10,7 +10,9 @@
 
 #ifdef __KERNEL__
 #include <linux/types.h>
+#include <linux/errno.h>
 #else
+#include <errno.h>
 #include <stddef.h> // size_t
 #include <stdint.h> // uintx_t
 #include <stdbool.h>
@@ -22,7 +24,15 @@ typedef enum
      TRUE = 1U
 } Boolean;
 
+/**
+ * Default number of entries of a ring, the actual capacity is set with
+ * aesd_circular_buffer_init() and aesd_circular_buffer_resize()
+ */
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+/**
+ * Upper bound of a ring capacity
+ */
+#define AESDCHAR_MAX_ENTRIES_LIMIT (1U << 20)
 
 struct aesd_buffer_entry
 {
@@ -34,27 +44,59 @@ struct aesd_buffer_entry
      * Number of bytes stored in buffptr
      */
     size_t size;
+    /**
+     * Number of bytes allocated for buffptr, grown geometrically while
+     * the entry is still partial (no newline received yet)
+     */
+    size_t capacity;
+    /**
+     * Stream position of the first byte, counted from the first byte ever
+     * added to the buffer. Maintained by aesd_circular_buffer_add_entry().
+     */
+    size_t start;
+    /**
+     * Sequence number, counted from the first entry ever added to the
+     * buffer. Maintained by aesd_circular_buffer_add_entry().
+     */
+    uint64_t seq;
 };
 
 struct aesd_circular_buffer
 {
     /**
-     * An array of pointers to memory allocated for the most recent write operations
+     * An array of capacity pointers to memory allocated for the most recent write operations
+     */
+    struct aesd_buffer_entry *entry;
+    /**
+     * Number of entries allocated for entry
      */
-    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    uint32_t capacity;
     /**
      * The current location in the entry structure where the next write should
      * be stored.
      */
-    uint8_t in_offs;
+    uint32_t in_offs;
     /**
      * The first location in the entry structure to read from
      */
-    uint8_t out_offs;
+    uint32_t out_offs;
     /**
      * set to true when the buffer entry structure is full
      */
     bool full;
+    /**
+     * Stream position of the oldest byte still held, char offsets passed to
+     * aesd_circular_buffer_find_entry_offset_for_fpos() are relative to it
+     */
+    size_t base_pos;
+    /**
+     * Stream position one past the newest byte
+     */
+    size_t end_pos;
+    /**
+     * Sequence number the next new entry gets
+     */
+    uint64_t end_seq;
 };
 
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
@@ -65,7 +107,18 @@ extern void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
                                            Boolean complete_entry,
                                            Boolean new_entry);
 
-extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
+extern int aesd_circular_buffer_init(struct aesd_circular_buffer *buffer, uint32_t capacity);
+
+extern void aesd_circular_buffer_destroy(struct aesd_circular_buffer *buffer);
+
+extern int aesd_circular_buffer_resize(struct aesd_circular_buffer *buffer, uint32_t capacity);
+
+extern uint32_t aesd_circular_buffer_count(struct aesd_circular_buffer *buffer);
+
+extern uint32_t aesd_circular_buffer_used(struct aesd_circular_buffer *buffer);
+
+extern bool aesd_circular_buffer_remove_oldest(struct aesd_circular_buffer *buffer,
+                                               struct aesd_buffer_entry *removed);
 
 extern long aesd_buffer_find_offset(struct aesd_circular_buffer *buffer, uint32_t write_cmd, uint32_t write_cmd_offset);
 
@@ -74,9 +127,9 @@ extern long aesd_buffer_find_offset(struct aesd_circular_buffer *buffer, uint32_
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a uint32_t stack allocated value used by this macro for an index
  * Example usage:
- * uint8_t index;
+ * uint32_t index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -85,7 +138,7 @@ extern long aesd_buffer_find_offset(struct aesd_circular_buffer *buffer, uint32_
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
     for(index=0, entryptr=&((buffer)->entry[index]); \
-            index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
+            index<(buffer)->capacity; \
             index++, entryptr=&((buffer)->entry[index]))
 
 
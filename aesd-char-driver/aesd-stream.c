@@ -0,0 +1,272 @@
+/**
+ * @file aesd-stream.c
+ * @brief kfifo backed byte stream mode of the aesdchar driver
+ *
+ * kfifo needs no locking with a single producer and a single consumer: the
+ * producer only advances kfifo.in, the consumer only advances kfifo.out.
+ * aesd_stream_open() admits one reader and one writer file, but a file can
+ * be shared by threads or inherited across fork(), so stream_read_lock and
+ * stream_write_lock keep each side down to one task at a time. The producer
+ * and the consumer never take each other's lock.
+ * Data is copied straight between the fifo and the iov_iter through the
+ * scatterlist kfifo_dma_*_prepare() describes, which skips the barriers the
+ * plain kfifo_in()/kfifo_out() would provide, so they are spelled out here.
+ */
+
+#include <linux/kfifo.h>
+#include <linux/scatterlist.h>
+#include <linux/wait.h>
+#include <linux/sched/signal.h>
+#include <linux/rwsem.h>
+#include <linux/mutex.h>
+#include <linux/cdev.h>
+#include "aesdchar.h"
+#include "aesd-stream.h"
+
+/*
+** Switches dev to stream mode with a fifo of size bytes, rounded up to a
+** power of two.
+** Returns: 0 on success, -EINVAL or -ENOMEM otherwise
+*/
+int aesd_stream_init(struct aesd_dev *dev, size_t size)
+{
+    int retval;
+
+    retval = kfifo_alloc(&dev->stream, size, GFP_KERNEL);
+    if (retval)
+    {
+        return retval;
+    }
+
+    atomic_set(&dev->stream_readers, 0);
+    atomic_set(&dev->stream_writers, 0);
+    mutex_init(&dev->stream_read_lock);
+    mutex_init(&dev->stream_write_lock);
+    dev->stream_mode = true;
+    return 0;
+}
+
+void aesd_stream_free(struct aesd_dev *dev)
+{
+    if (dev->stream_mode)
+    {
+        kfifo_free(&dev->stream);
+        dev->stream_mode = false;
+    }
+}
+
+/*
+** Admits filp as the reader and/or the writer of the stream.
+** Returns: 0 on success, -EBUSY if that end is already open
+*/
+int aesd_stream_open(struct aesd_dev *dev, struct inode *inode, struct file *filp)
+{
+    if ((filp->f_mode & FMODE_READ) && (atomic_cmpxchg(&dev->stream_readers, 0, 1) != 0))
+    {
+        return -EBUSY;
+    }
+
+    if ((filp->f_mode & FMODE_WRITE) && (atomic_cmpxchg(&dev->stream_writers, 0, 1) != 0))
+    {
+        if (filp->f_mode & FMODE_READ)
+        {
+            atomic_set(&dev->stream_readers, 0);
+        }
+
+        return -EBUSY;
+    }
+
+    /* No file position, reads always consume from the head of the fifo */
+    return stream_open(inode, filp);
+}
+
+void aesd_stream_release(struct aesd_dev *dev, struct file *filp)
+{
+    if (filp->f_mode & FMODE_READ)
+    {
+        atomic_set(&dev->stream_readers, 0);
+    }
+
+    if (filp->f_mode & FMODE_WRITE)
+    {
+        atomic_set(&dev->stream_writers, 0);
+    }
+}
+
+/*
+** Consumes up to iov_iter_count(to) bytes. An empty fifo returns 0 unless
+** block is set, then the reader waits for data (O_NONBLOCK gets -EAGAIN).
+** Returns: bytes read, or -EAGAIN, -ERESTARTSYS or -EFAULT
+*/
+ssize_t aesd_stream_read(struct aesd_dev *dev, struct file *filp, struct iov_iter *to, bool block)
+{
+    struct scatterlist sgl[2];
+    unsigned int nents;
+    unsigned int index;
+    size_t copied = 0U;
+    size_t span;
+
+    if (iov_iter_count(to) == 0)
+    {
+        return 0;
+    }
+
+    while (true)
+    {
+        while (kfifo_is_empty(&dev->stream))
+        {
+            if (!block)
+            {
+                return 0;
+            }
+
+            if (filp->f_flags & O_NONBLOCK)
+            {
+                return -EAGAIN;
+            }
+
+            if (wait_event_interruptible(dev->read_queue, !kfifo_is_empty(&dev->stream)))
+            {
+                return -ERESTARTSYS;
+            }
+        }
+
+        if (mutex_lock_interruptible(&dev->stream_read_lock))
+        {
+            return -ERESTARTSYS;
+        }
+
+        /* Another task sharing the read end may have drained it meanwhile */
+        if (!kfifo_is_empty(&dev->stream))
+        {
+            break;
+        }
+
+        mutex_unlock(&dev->stream_read_lock);
+    }
+
+    sg_init_table(sgl, ARRAY_SIZE(sgl));
+    nents = kfifo_dma_out_prepare(&dev->stream, sgl, ARRAY_SIZE(sgl), iov_iter_count(to));
+
+    /* Pairs with the producer's smp_wmb(), bytes below kfifo.in are written */
+    smp_rmb();
+    for (index = 0; index < nents; index++)
+    {
+        span = copy_to_iter(sg_virt(&sgl[index]), sgl[index].length, to);
+        copied += span;
+        if (span != sgl[index].length)
+        {
+            break;
+        }
+    }
+
+    /* The bytes must be read before the producer sees the space as free */
+    smp_mb();
+    kfifo_dma_out_finish(&dev->stream, copied);
+    mutex_unlock(&dev->stream_read_lock);
+    if (copied == 0)
+    {
+        return -EFAULT;
+    }
+
+    wake_up_interruptible(&dev->write_queue);
+    return copied;
+}
+
+/*
+** Appends as much of from as fits, waiting while the fifo is full
+** (O_NONBLOCK gets -EAGAIN). A short count means the fifo filled up.
+** Returns: bytes written, or -EAGAIN, -ERESTARTSYS or -EFAULT
+*/
+ssize_t aesd_stream_write(struct aesd_dev *dev, struct file *filp, struct iov_iter *from)
+{
+    struct scatterlist sgl[2];
+    unsigned int nents;
+    unsigned int index;
+    size_t copied = 0U;
+    size_t span;
+
+    if (iov_iter_count(from) == 0)
+    {
+        return 0;
+    }
+
+    while (true)
+    {
+        while (kfifo_is_full(&dev->stream))
+        {
+            if (filp->f_flags & O_NONBLOCK)
+            {
+                return -EAGAIN;
+            }
+
+            if (wait_event_interruptible(dev->write_queue, !kfifo_is_full(&dev->stream)))
+            {
+                return -ERESTARTSYS;
+            }
+        }
+
+        if (mutex_lock_interruptible(&dev->stream_write_lock))
+        {
+            return -ERESTARTSYS;
+        }
+
+        /* Another task sharing the write end may have filled it meanwhile */
+        if (!kfifo_is_full(&dev->stream))
+        {
+            break;
+        }
+
+        mutex_unlock(&dev->stream_write_lock);
+    }
+
+    sg_init_table(sgl, ARRAY_SIZE(sgl));
+    nents = kfifo_dma_in_prepare(&dev->stream, sgl, ARRAY_SIZE(sgl), iov_iter_count(from));
+
+    /* Pairs with the consumer's smp_mb(), space above kfifo.out is no longer read */
+    smp_mb();
+    for (index = 0; index < nents; index++)
+    {
+        span = copy_from_iter(sg_virt(&sgl[index]), sgl[index].length, from);
+        copied += span;
+        if (span != sgl[index].length)
+        {
+            break;
+        }
+    }
+
+    /* The bytes must be visible before kfifo.in covers them */
+    smp_wmb();
+    kfifo_dma_in_finish(&dev->stream, copied);
+    mutex_unlock(&dev->stream_write_lock);
+    if (copied == 0)
+    {
+        return -EFAULT;
+    }
+
+    wake_up_interruptible(&dev->read_queue);
+    return copied;
+}
+
+/*
+** Readable while the fifo holds data, writable while it has room
+*/
+__poll_t aesd_stream_poll(struct aesd_dev *dev, struct file *filp, poll_table *wait)
+{
+    __poll_t mask = 0;
+
+    poll_wait(filp, &dev->read_queue, wait);
+    poll_wait(filp, &dev->write_queue, wait);
+
+    if (!kfifo_is_empty(&dev->stream))
+    {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+
+    if (!kfifo_is_full(&dev->stream))
+    {
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    }
+
+    return mask;
+}
@@ -0,0 +1,35 @@
+/*
+ * aesd-stream.h
+ *
+ *  @brief Byte stream mode of the aesdchar driver
+ *
+ *  A stream device keeps no record boundaries: writes append to a kfifo and
+ *  reads consume from it, like a pipe. One reader and one writer may have it
+ *  open at a time, so neither side takes dev->rw_lock; each side only takes
+ *  its own mutex against tasks sharing its file.
+ */
+
+#ifndef AESD_STREAM_H
+#define AESD_STREAM_H
+
+#include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/uio.h>
+
+struct aesd_dev;
+
+extern int aesd_stream_init(struct aesd_dev *dev, size_t size);
+
+extern void aesd_stream_free(struct aesd_dev *dev);
+
+extern int aesd_stream_open(struct aesd_dev *dev, struct inode *inode, struct file *filp);
+
+extern void aesd_stream_release(struct aesd_dev *dev, struct file *filp);
+
+extern ssize_t aesd_stream_read(struct aesd_dev *dev, struct file *filp, struct iov_iter *to, bool block);
+
+extern ssize_t aesd_stream_write(struct aesd_dev *dev, struct file *filp, struct iov_iter *from);
+
+extern __poll_t aesd_stream_poll(struct aesd_dev *dev, struct file *filp, poll_table *wait);
+
+#endif /* AESD_STREAM_H */
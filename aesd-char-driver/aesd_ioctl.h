@@ -33,14 +33,174 @@ struct aesd_seekto {
     uint32_t write_cmd_offset;
 };
 
+/**
+ * Ring limits of an aesdchar device, set with AESDCHAR_IOCSRING and read
+ * back with AESDCHAR_IOCGRING
+ */
+struct aesd_ring_config {
+    /**
+     * Number of entries the ring holds before the oldest one is overwritten
+     */
+    uint32_t max_entries;
+    /**
+     * What a write that needs the room of an unread entry does, one of AESD_OVERFLOW_*
+     */
+    uint32_t overflow_policy;
+    /**
+     * Total bytes kept before the oldest entries are evicted, 0 - unlimited
+     */
+    uint64_t max_bytes;
+};
+
+/**
+ * Overflow policies. An entry is read once any reader has read past its end
+ * with read() or AESDCHAR_IOCSEEKREAD, read entries are always evicted freely.
+ */
+#define AESD_OVERFLOW_OVERWRITE 0 /* evict the oldest entry, read or not */
+#define AESD_OVERFLOW_BLOCK     1 /* wait until it is read, O_NONBLOCK gets -EAGAIN */
+#define AESD_OVERFLOW_REJECT    2 /* fail the write with -ENOSPC */
+#define AESD_OVERFLOW_MAX       AESD_OVERFLOW_REJECT
+
+/**
+ * Data loss and backpressure of a device, returned by AESDCHAR_IOCGOVERRUN
+ */
+struct aesd_overrun_info {
+    /**
+     * Entries evicted before any reader read them, and their bytes
+     */
+    uint64_t entries_lost;
+    uint64_t bytes_lost;
+    /**
+     * Writes failed with -ENOSPC, and the times a write waited for readers
+     */
+    uint64_t writes_rejected;
+    uint64_t writes_blocked;
+};
+
+/**
+ * One entry of the table returned by AESDCHAR_IOCGENTRIES
+ */
+struct aesd_entry_info {
+    /**
+     * Sequence number, counted from the first entry ever written to the device
+     */
+    uint64_t seq;
+    /**
+     * File offset of the first byte, as used by lseek() and read()
+     */
+    uint64_t offset;
+    uint64_t size;
+    /**
+     * AESD_ENTRY_PARTIAL while the entry has no newline yet
+     */
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+#define AESD_ENTRY_PARTIAL 0x1
+
+/**
+ * Request of AESDCHAR_IOCGENTRIES
+ */
+struct aesd_entry_table {
+    /**
+     * User pointer to max_entries struct aesd_entry_info, filled oldest entry first
+     */
+    uint64_t entries;
+    uint32_t max_entries;
+    /**
+     * Set to the number of entries held, retry with a larger table if it
+     * exceeds max_entries
+     */
+    uint32_t count;
+};
+
+/**
+ * Request of AESDCHAR_IOCSEEKREAD, seeks like AESDCHAR_IOCSEEKTO and reads
+ * from there in the same call. The file position ends after the data read.
+ */
+struct aesd_seek_read {
+    uint32_t write_cmd;
+    uint32_t write_cmd_offset;
+    /**
+     * User pointer to the buffer receiving the data
+     */
+    uint64_t buf;
+    /**
+     * Size of buf in, bytes read out
+     */
+    uint64_t len;
+};
+
+#define AESD_MMAP_MAGIC 0x41455344 /* "AESD" */
+#define AESD_MMAP_VERSION 1
+
+/**
+ * Location of one entry in the mapped arena
+ */
+struct aesd_mmap_entry {
+    /**
+     * Stream position of the first byte, the byte at stream position p is
+     * stored at arena[p % arena_size]
+     */
+    uint64_t start;
+    uint64_t size;
+};
+
+/**
+ * Header at offset 0 of a read-only mmap() of an aesdchar device.
+ *
+ * Readers sample generation, copy what they need and sample it again.
+ * The copy is consistent if both samples are equal and even. Only bytes
+ * at stream positions >= end_pos - arena_size are still in the arena.
+ */
+struct aesd_mmap_header {
+    uint32_t magic;
+    uint32_t version;
+    /**
+     * Odd while the driver is updating the mapping
+     */
+    uint32_t generation;
+    /**
+     * Number of slots of entries[], equal to the ring capacity
+     */
+    uint32_t capacity;
+    /**
+     * Slot of the oldest entry, entry k lives in entries[(first_slot + k) % capacity]
+     */
+    uint32_t first_slot;
+    /**
+     * Entries holding data, the last one may still be partial (no newline yet)
+     */
+    uint32_t entry_count;
+    /**
+     * Offset of the arena from the start of the mapping, page aligned
+     */
+    uint64_t arena_offset;
+    uint64_t arena_size;
+    /**
+     * Stream positions of the oldest byte held and one past the newest
+     */
+    uint64_t base_pos;
+    uint64_t end_pos;
+    struct aesd_mmap_entry entries[];
+};
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+// Resize the ring at runtime, entries that no longer fit are evicted oldest first
+#define AESDCHAR_IOCSRING _IOW(AESD_IOC_MAGIC, 2, struct aesd_ring_config)
+#define AESDCHAR_IOCGRING _IOR(AESD_IOC_MAGIC, 3, struct aesd_ring_config)
+// Entry boundaries without reading the data, and a seek and read in one call
+#define AESDCHAR_IOCGENTRIES _IOWR(AESD_IOC_MAGIC, 4, struct aesd_entry_table)
+#define AESDCHAR_IOCSEEKREAD _IOWR(AESD_IOC_MAGIC, 5, struct aesd_seek_read)
+#define AESDCHAR_IOCGOVERRUN _IOR(AESD_IOC_MAGIC, 6, struct aesd_overrun_info)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 6
 
 #endif /* AESD_IOCTL_H */
@@ -10,7 +10,7 @@
 #ifndef AESD_CHAR_DRIVER_AESDCHAR_H_
 #define AESD_CHAR_DRIVER_AESDCHAR_H_
 
-#define AESD_DEBUG 1  //Remove comment on this line to enable debug
+// #define AESD_DEBUG 1  //Remove comment on this line to enable debug, use the aesdchar tracepoints otherwise
 
 #undef PDEBUG             /* undef it, just in case */
 #ifdef AESD_DEBUG
@@ -25,13 +25,66 @@
 #  define PDEBUG(fmt, args...) /* not debugging: nothing */
 #endif
 
+#define AESDCHAR_MAX_DEVICES 64 /* upper bound of the aesd_nr_devs module parameter */
+#define AESD_LATENCY_BUCKETS 32  /* bucket k counts calls of [2^k, 2^(k+1)) ns, the last one everything above */
+
+/*
+ * Per device counters shown in <debugfs>/aesdchar/devN/stats. Readers run
+ * concurrently under the shared lock, so every counter is atomic.
+ */
+struct aesd_stats
+{
+    atomic64_t bytes_written;
+    atomic64_t entries_written;   /* completed by a newline */
+    atomic64_t entries_evicted;
+    atomic64_t bytes_evicted;
+    atomic64_t reads;
+    atomic64_t bytes_read;
+    atomic64_t seeks;             /* llseek() and AESDCHAR_IOCSEEKTO */
+    atomic64_t alloc_failures;
+    atomic64_t entries_lost;      /* evicted before any reader read them */
+    atomic64_t bytes_lost;
+    atomic64_t writes_rejected;
+    atomic64_t writes_blocked;
+    atomic64_t read_lock_contended;
+    atomic64_t read_lock_wait_ns;
+    atomic64_t write_lock_contended;
+    atomic64_t write_lock_wait_ns;
+    atomic64_t read_latency[AESD_LATENCY_BUCKETS];
+    atomic64_t write_latency[AESD_LATENCY_BUCKETS];
+};
+
 struct aesd_dev
 {
     Boolean write_entry_new_flag; /* Flag to indicate new write buffer entry */
     struct aesd_circular_buffer *circ_buffer; /* Circular buffer for AESD data */
-    struct mutex mutex_lock; /* Mutex for synchronizing access to the circular buffer */
+    struct rw_semaphore rw_lock; /* Readers share the circular buffer, writers and resizes own it */
     struct cdev cdev;     /* Char device structure      */
     unsigned long size;       /* amount of data stored here */
+    unsigned long max_bytes;  /* oldest entries are evicted above it, 0 - unlimited */
+    uint8_t *arena;           /* contiguous payload storage, NULL - one slab buffer per entry */
+    size_t arena_size;
+    size_t arena_tail;        /* arena offset one past the newest byte */
+    void *mmap_area;          /* vmalloc_user() header pages followed by the arena, NULL - no mmap */
+    size_t mmap_size;
+    struct aesd_mmap_header *mmap_header;
+    uint8_t *mmap_arena;
+    atomic_t mmap_count;      /* live mappings, the ring cannot be resized while mapped */
+    struct mutex mmap_lock;   /* mmap_area lifetime against ->mmap, never held across user copies */
+    wait_queue_head_t read_queue; /* woken when an entry is completed */
+    size_t committed_pos;     /* stream position one past the newest complete entry */
+    size_t consumed_pos;      /* furthest stream position any reader has read to */
+    uint32_t overflow_policy; /* AESD_OVERFLOW_*, for the ring only */
+    atomic_t room_events;     /* bumped when reads or a resize may free room */
+    struct aesd_stats stats;
+    struct dentry *debugfs_dir;
+    bool stream_mode;         /* kfifo byte stream instead of the ring, fixed at load */
+    struct kfifo stream;
+    atomic_t stream_readers;  /* open read ends, at most one */
+    atomic_t stream_writers;  /* open write ends, at most one */
+    struct mutex stream_read_lock;  /* tasks sharing the read end consume one at a time */
+    struct mutex stream_write_lock; /* tasks sharing the write end produce one at a time */
+    wait_queue_head_t write_queue; /* writers waiting for fifo or ring room */
 };
 
 
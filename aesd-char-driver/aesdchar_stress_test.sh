@@ -0,0 +1,88 @@
+#!/bin/sh
+# Multi-reader stress test for the aesdchar driver
+#
+# Writers append sequenced lines while readers keep reading the whole
+# device. Every stress line a reader sees must be intact and the sequence
+# numbers of each writer must increase, otherwise readers observed a
+# half-written or already freed entry.
+#
+# Usage: ./aesdchar_stress_test.sh [readers] [writers] [lines per writer]
+# Run against a loaded module, DEVICE overrides /dev/aesdchar.
+device=${DEVICE:-/dev/aesdchar}
+readers=${1:-8}
+writers=${2:-2}
+lines=${3:-2000}
+tag=aesdstress
+workdir=$(mktemp -d)
+trap 'rm -rf "${workdir}"' EXIT
+
+if [ ! -c "${device}" ]; then
+    echo "${device} is not a character device, load the module first"
+    exit 1
+fi
+
+writer() {
+    seq=0
+    while [ ${seq} -lt ${lines} ]; do
+        # One write() per line, each line becomes one complete entry
+        printf '%s writer%d seq %d payload-payload-payload\n' ${tag} $1 ${seq} > ${device}
+        seq=$((seq + 1))
+    done
+}
+
+reader() {
+    reads=0
+    while [ ! -e "${workdir}/done" ]; do
+        # A single read() returns a consistent snapshot of the whole ring
+        if ! dd if=${device} bs=1048576 count=1 2>/dev/null | awk -v tag=${tag} '
+            index($0, tag) == 0 && index($0, "payload") == 0 { next }
+            $0 !~ ("^" tag " writer[0-9]+ seq [0-9]+ payload-payload-payload$") {
+                print "torn line: " $0; exit 1
+            }
+            {
+                seq = $4 + 0
+                if (($2 in last) && (seq <= last[$2])) {
+                    print "out of order: " $0 " after seq " last[$2]; exit 1
+                }
+                last[$2] = seq
+            }' > "${workdir}/reader$1.log"; then
+            touch "${workdir}/failed"
+            cat "${workdir}/reader$1.log"
+            break
+        fi
+        reads=$((reads + 1))
+    done
+    echo ${reads} > "${workdir}/reader$1.reads"
+}
+
+echo "Stressing ${device}: ${readers} readers, ${writers} writers, ${lines} lines each"
+start=$(date +%s)
+
+i=0
+while [ ${i} -lt ${readers} ]; do
+    reader ${i} &
+    i=$((i + 1))
+done
+
+writer_pids=""
+i=0
+while [ ${i} -lt ${writers} ]; do
+    writer ${i} &
+    writer_pids="${writer_pids} $!"
+    i=$((i + 1))
+done
+
+wait ${writer_pids}
+touch "${workdir}/done"
+wait
+
+total_reads=$(cat "${workdir}"/reader*.reads | awk '{ sum += $1 } END { print sum }')
+echo "${total_reads} snapshots read in $(( $(date +%s) - start )) s"
+
+if [ -e "${workdir}/failed" ]; then
+    echo "FAILED: readers observed inconsistent data"
+    exit 1
+fi
+
+echo "PASSED"
+exit 0
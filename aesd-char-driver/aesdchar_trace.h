@@ -0,0 +1,125 @@
+/*
+ * aesdchar_trace.h
+ *
+ *  @brief Tracepoints for the aesdchar driver
+ *
+ *  Each start/end pair brackets one call so perf or bpftrace can measure its
+ *  latency, e.g. "perf record -e 'aesdchar:*'". A disabled tracepoint costs a
+ *  single static branch, unlike PDEBUG.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM aesdchar
+
+#if !defined(AESDCHAR_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define AESDCHAR_TRACE_H
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(aesd_io_start,
+
+    TP_PROTO(size_t count, loff_t pos),
+
+    TP_ARGS(count, pos),
+
+    TP_STRUCT__entry(
+        __field(size_t, count)
+        __field(loff_t, pos)
+    ),
+
+    TP_fast_assign(
+        __entry->count = count;
+        __entry->pos = pos;
+    ),
+
+    TP_printk("count=%zu pos=%lld", __entry->count, __entry->pos)
+);
+
+DEFINE_EVENT(aesd_io_start, aesd_read_start,
+    TP_PROTO(size_t count, loff_t pos),
+    TP_ARGS(count, pos)
+);
+
+DEFINE_EVENT(aesd_io_start, aesd_write_start,
+    TP_PROTO(size_t count, loff_t pos),
+    TP_ARGS(count, pos)
+);
+
+DECLARE_EVENT_CLASS(aesd_io_end,
+
+    TP_PROTO(ssize_t retval, loff_t pos),
+
+    TP_ARGS(retval, pos),
+
+    TP_STRUCT__entry(
+        __field(ssize_t, retval)
+        __field(loff_t, pos)
+    ),
+
+    TP_fast_assign(
+        __entry->retval = retval;
+        __entry->pos = pos;
+    ),
+
+    TP_printk("retval=%zd pos=%lld", __entry->retval, __entry->pos)
+);
+
+DEFINE_EVENT(aesd_io_end, aesd_read_end,
+    TP_PROTO(ssize_t retval, loff_t pos),
+    TP_ARGS(retval, pos)
+);
+
+DEFINE_EVENT(aesd_io_end, aesd_write_end,
+    TP_PROTO(ssize_t retval, loff_t pos),
+    TP_ARGS(retval, pos)
+);
+
+TRACE_EVENT(aesd_evict,
+
+    TP_PROTO(size_t size, unsigned long dev_size),
+
+    TP_ARGS(size, dev_size),
+
+    TP_STRUCT__entry(
+        __field(size_t, size)
+        __field(unsigned long, dev_size)
+    ),
+
+    TP_fast_assign(
+        __entry->size = size;
+        __entry->dev_size = dev_size;
+    ),
+
+    TP_printk("size=%zu dev_size=%lu", __entry->size, __entry->dev_size)
+);
+
+TRACE_EVENT(aesd_adjust_file_offset,
+
+    TP_PROTO(uint32_t write_cmd, uint32_t write_cmd_offset, long offset),
+
+    TP_ARGS(write_cmd, write_cmd_offset, offset),
+
+    TP_STRUCT__entry(
+        __field(uint32_t, write_cmd)
+        __field(uint32_t, write_cmd_offset)
+        __field(long, offset)
+    ),
+
+    TP_fast_assign(
+        __entry->write_cmd = write_cmd;
+        __entry->write_cmd_offset = write_cmd_offset;
+        __entry->offset = offset;
+    ),
+
+    TP_printk("write_cmd=%u write_cmd_offset=%u offset=%ld",
+              __entry->write_cmd, __entry->write_cmd_offset, __entry->offset)
+);
+
+#endif /* AESDCHAR_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE aesdchar_trace
+#include <trace/define_trace.h>
@@ -12,17 +12,37 @@
  */
 
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/init.h>
 #include <linux/printk.h>
 #include <linux/types.h>
 #include <linux/cdev.h>
 #include <linux/gfp.h>  /* kmalloc flags */
 #include <linux/slab.h>  /* kmalloc */
-#include <linux/mutex.h> /* mutex */
+#include <linux/rwsem.h> /* rw_semaphore */
+#include <linux/mutex.h>
 #include <linux/fs.h> // file_operations
+#include <linux/uio.h> /* iov_iter */
+#include <linux/splice.h>
+#include <linux/mm.h> /* vm_area_struct */
+#include <linux/vmalloc.h> /* vmalloc_user */
+#include <linux/version.h>
+#include <linux/wait.h> /* wait_queue_head_t */
+#include <linux/poll.h>
+#include <linux/kfifo.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
 #include "aesdchar.h"
+#include "aesd-alloc.h"
+#include "aesd-stream.h"
 #include "aesd-circular-buffer.h"
 #include "aesd_ioctl.h"
+
+#define CREATE_TRACE_POINTS
+#include "aesdchar_trace.h"
+
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
 
@@ -30,10 +50,64 @@ int aesd_minor =   0;
 MODULE_AUTHOR("JustOxy666");
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct aesd_dev *aesd_device;
+static unsigned int aesd_nr_devs = 1;
+module_param(aesd_nr_devs, uint, S_IRUGO);
+MODULE_PARM_DESC(aesd_nr_devs, "Number of independent devices, minor 0 is /dev/aesdchar and minor N is /dev/aesdcharN");
+
+static unsigned int aesd_max_entries = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param(aesd_max_entries, uint, S_IRUGO);
+MODULE_PARM_DESC(aesd_max_entries, "Initial entries kept in each ring, changed per device with AESDCHAR_IOCSRING");
+
+static unsigned long aesd_max_bytes = 0;
+module_param(aesd_max_bytes, ulong, S_IRUGO);
+MODULE_PARM_DESC(aesd_max_bytes, "Initial bytes kept in each ring before the oldest entries are evicted, 0 - unlimited");
+
+static bool aesd_blocking_read = false;
+module_param(aesd_blocking_read, bool, S_IRUGO);
+MODULE_PARM_DESC(aesd_blocking_read, "Reads at the end of the data wait for the next complete entry (O_NONBLOCK gets -EAGAIN)");
+
+static unsigned int aesd_overflow_policy = AESD_OVERFLOW_OVERWRITE;
+module_param(aesd_overflow_policy, uint, S_IRUGO);
+MODULE_PARM_DESC(aesd_overflow_policy, "Initial policy when a write needs the room of an unread entry: 0 - overwrite, 1 - block, 2 - reject with -ENOSPC");
+
+static unsigned long aesd_arena_bytes = 0;
+module_param(aesd_arena_bytes, ulong, S_IRUGO);
+MODULE_PARM_DESC(aesd_arena_bytes, "Store payloads in one preallocated byte ring of this size per device, 0 - one slab buffer per entry");
+
+static unsigned long long aesd_stream_mask = 0;
+module_param(aesd_stream_mask, ullong, S_IRUGO);
+MODULE_PARM_DESC(aesd_stream_mask, "Bit N set - minor N is a byte stream (one reader, one writer, no record boundaries) instead of a ring of entries");
+
+static unsigned long aesd_stream_bytes = 64 * 1024;
+module_param(aesd_stream_bytes, ulong, S_IRUGO);
+MODULE_PARM_DESC(aesd_stream_bytes, "Fifo size of stream devices, rounded up to a power of two");
+
+static unsigned long aesd_mmap_bytes = 1024 * 1024;
+module_param(aesd_mmap_bytes, ulong, S_IRUGO);
+MODULE_PARM_DESC(aesd_mmap_bytes, "Size of the arena mirrored to mmap() readers, 0 - no mmap support");
+
+struct aesd_dev *aesd_devices; /* aesd_nr_devs devices, indexed by minor */
+static struct dentry *aesd_debugfs_dir; /* <debugfs>/aesdchar */
 
 void aesd_cleanup_module(void);
 static long aesd_adjust_file_offset(struct file *filp, uint32_t write_cmd, uint32_t write_cmd_offset);
+static bool aesd_evict_oldest(struct aesd_dev *dev, loff_t *f_pos);
+static bool aesd_evict_for_write(struct aesd_dev *dev, loff_t *f_pos);
+static int aesd_make_room(struct aesd_dev *dev, size_t count, loff_t *f_pos);
+static void aesd_mark_consumed(struct aesd_dev *dev, size_t position);
+static void aesd_enforce_byte_budget(struct aesd_dev *dev, loff_t *f_pos);
+static char *aesd_arena_reserve(struct aesd_dev *dev, size_t count, loff_t *f_pos);
+static bool aesd_arena_place(struct aesd_dev *dev, uint32_t gone, size_t size, size_t *start);
+static bool aesd_write_has_room(struct aesd_dev *dev, size_t count);
+static int aesd_lock_read(struct aesd_dev *dev);
+static int aesd_lock_write(struct aesd_dev *dev);
+static void aesd_record_latency(atomic64_t *histogram, u64 start_ns);
+static ssize_t aesd_copy_to_iter(struct aesd_dev *dev, loff_t *f_pos, struct iov_iter *to);
+static long aesd_get_entries(struct aesd_dev *dev, struct aesd_entry_table *table);
+static long aesd_seek_read(struct file *filp, struct aesd_seek_read *request);
+static long aesd_set_ring(struct aesd_dev *dev, const struct aesd_ring_config *config);
+static int aesd_mmap_alloc(struct aesd_dev *dev);
+static void aesd_mmap_publish(struct aesd_dev *dev, uint32_t slot, size_t offset, size_t count);
 
 
 int aesd_open(struct inode *inode, struct file *filp)
@@ -45,6 +119,11 @@ int aesd_open(struct inode *inode, struct file *filp)
 
     PDEBUG("open");
 
+    if (dev->stream_mode)
+    {
+        return aesd_stream_open(dev, inode, filp);
+    }
+
     return 0;
 }
 
@@ -55,128 +134,243 @@ int aesd_release(struct inode *inode, struct file *filp)
     struct aesd_dev *dev;
 
     dev = filp->private_data;
+    if (dev->stream_mode)
+    {
+        aesd_stream_release(dev, filp);
+    }
 
     return 0;
 }
 
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+/*
+** Backs read(), readv() and, through splice_read, sendfile() and splice()
+*/
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
+    struct file *filp = iocb->ki_filp;
+    loff_t *f_pos = &iocb->ki_pos;
+    size_t count = iov_iter_count(to);
     ssize_t retval = 0;
-    uint16_t read_bytes = 0U;
-    size_t entry_offset_byte_rtn = 0U;
+    size_t wait_pos = 0U;
+    bool waited = false;
+    u64 start_ns = ktime_get_ns();
     struct aesd_dev *dev;
-    struct aesd_buffer_entry *entry;
 
     PDEBUG("-------------");
-    PDEBUG("aesd_read debug info:");
+    PDEBUG("aesd_read_iter debug info:");
     PDEBUG("filp->f_pos %lld", filp->f_pos);
     PDEBUG("read %zu bytes with offset %lld",count,*f_pos);
+    trace_aesd_read_start(count, *f_pos);
     dev = filp->private_data;
 
+    if (dev->stream_mode)
+    {
+        /* Single consumer, no dev->rw_lock */
+        retval = aesd_stream_read(dev, filp, to, aesd_blocking_read);
+        if (retval < 0)
+        {
+            goto out;
+        }
+
+        goto account;
+    }
+
+    retry:
     /* --------- ENTER CRITICAL SECTION ---------- */
-    if (mutex_lock_interruptible(&dev->mutex_lock))
+    if (aesd_lock_read(dev))
     {
 		retval = -ERESTARTSYS;
         goto out;
     }
 
-    entry = aesd_circular_buffer_find_entry_offset_for_fpos(dev->circ_buffer, *f_pos, &entry_offset_byte_rtn);
-    if (entry == NULL)
+    if (waited)
     {
-        PDEBUG("NULL entry detected");
-        goto unlock;
+        /* Offsets are relative to the oldest entry, which may have moved while waiting */
+        *f_pos = (wait_pos > dev->circ_buffer->base_pos) ? (wait_pos - dev->circ_buffer->base_pos) : 0;
     }
 
-    PDEBUG("entry->buffptr = %s", entry->buffptr);
-    PDEBUG("entry->size = %zu bytes", entry->size);
-    PDEBUG("entry_offset_byte_rtn = %zu", entry_offset_byte_rtn);
-
-    read_bytes = 0U;
+    retval = aesd_copy_to_iter(dev, f_pos, to);
+    if (retval > 0)
+    {
+        aesd_mark_consumed(dev, dev->circ_buffer->base_pos + *f_pos);
+    }
 
-    /* Go through the entry and read every byte from offset value */
-    while ((read_bytes + entry_offset_byte_rtn) < entry->size)
+    if ((retval == 0) && (count > 0) && aesd_blocking_read)
     {
-        if (entry->buffptr != NULL)
+        /* Nothing at *f_pos yet, tail the device: wait for the next complete entry */
+        wait_pos = dev->circ_buffer->base_pos + ((*f_pos > 0) ? *f_pos : 0);
+        up_read(&dev->rw_lock);
+
+        if (filp->f_flags & O_NONBLOCK)
         {
-            copy_to_user((const char*)buf + read_bytes,
-                        entry->buffptr + read_bytes + entry_offset_byte_rtn, 
-                        sizeof(char));
-            read_bytes++;
-
-            /* Check if we read all the entry */
-            if ((read_bytes + entry_offset_byte_rtn) >= count)
-            {   
-                PDEBUG("read_bytes >= count, breaking out of loop");
-                break;
-            }
+            retval = -EAGAIN;
+            goto out;
+        }
+
+        if (wait_event_interruptible(dev->read_queue, READ_ONCE(dev->committed_pos) > wait_pos))
+        {
+            retval = -ERESTARTSYS;
+            goto out;
         }
+
+        /* Time spent waiting for data is not read latency */
+        waited = true;
+        start_ns = ktime_get_ns();
+        goto retry;
     }
 
-    *f_pos += read_bytes;
-    retval += read_bytes;
     PDEBUG("-------------");
-    PDEBUG("completed reading entry");
-    PDEBUG("read %zu bytes from entry", read_bytes);
+    PDEBUG("read %zd bytes", retval);
     PDEBUG("filp->f_pos %lld", *f_pos);
     PDEBUG("-------------");
-    
-    unlock:
-    mutex_unlock(&dev->mutex_lock);
+
+    up_read(&dev->rw_lock);
     /* --------- EXIT CRITICAL SECTION ---------- */
-    
+
+    account:
+    atomic64_inc(&dev->stats.reads);
+    if (retval > 0)
+    {
+        atomic64_add(retval, &dev->stats.bytes_read);
+    }
+
+    aesd_record_latency(dev->stats.read_latency, start_ns);
+
     out:
+    trace_aesd_read_end(retval, *f_pos);
+    return retval;
+}
+
+
+/*
+** Fills to from *f_pos on, across entry boundaries with one copy per entry
+** span, and advances *f_pos. Caller holds dev->rw_lock.
+** Returns: bytes copied, -EFAULT if the first copy faulted
+*/
+static ssize_t aesd_copy_to_iter(struct aesd_dev *dev, loff_t *f_pos, struct iov_iter *to)
+{
+    ssize_t retval = 0;
+    size_t count = iov_iter_count(to);
+    size_t span = 0U;
+    size_t not_copied = 0U;
+    size_t entry_offset_byte_rtn = 0U;
+    struct aesd_buffer_entry *entry;
+
+    while ((size_t)retval < count)
+    {
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(dev->circ_buffer, *f_pos, &entry_offset_byte_rtn);
+        if ((entry == NULL) || (entry->buffptr == NULL))
+        {
+            PDEBUG("no more data at offset %lld", *f_pos);
+            break;
+        }
+
+        span = min(entry->size - entry_offset_byte_rtn, count - (size_t)retval);
+        not_copied = span - copy_to_iter(entry->buffptr + entry_offset_byte_rtn, span, to);
+
+        /* Account whatever made it before a fault */
+        *f_pos += span - not_copied;
+        retval += span - not_copied;
+        if (not_copied != 0)
+        {
+            PDEBUG("copy_to_iter faulted, %zu of %zu bytes not copied", not_copied, span);
+            if (retval == 0)
+            {
+                retval = -EFAULT;
+            }
+
+            break;
+        }
+    }
+
     return retval;
 }
 
 
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
+/*
+** Backs write(), writev() and splice_write. All segments of one call become
+** part of the same entry.
+*/
+ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-    ssize_t retval, buf_offset = 0;
+    struct file *filp = iocb->ki_filp;
+    loff_t *f_pos = &iocb->ki_pos;
+    size_t count = iov_iter_count(from);
+    ssize_t retval = 0, buf_offset = 0;
+    size_t capacity = 0;
+    char *buffptr = NULL;
+    uint32_t slot = 0;
+    bool completed = false;
+    int room = 0;
+    u64 start_ns = ktime_get_ns();
     struct aesd_dev *dev;
-    struct aesd_buffer_entry *new_entry;
+    struct aesd_buffer_entry new_entry;
+    struct aesd_buffer_entry *partial_entry;
 
     PDEBUG("write %zu bytes with offset %lld", count, *f_pos);
+    trace_aesd_write_start(count, *f_pos);
     dev = filp->private_data;
 
+    if (dev->stream_mode)
+    {
+        /* Single producer, no dev->rw_lock */
+        retval = aesd_stream_write(dev, filp, from);
+        if (retval < 0)
+        {
+            goto out;
+        }
+
+        goto account;
+    }
+
+    retry:
     /* --------- ENTER CRITICAL SECTION ---------- */
-    if (mutex_lock_interruptible(&dev->mutex_lock))
+    if (aesd_lock_write(dev))
     {
 		retval = -ERESTARTSYS;
         goto out;
     }
 
-    /* Free memory for oldest entry is the buffer is full and previaous enrty was completed */
-    if ((dev->circ_buffer->full == true) && (dev->write_entry_new_flag == TRUE))
+    retval = aesd_make_room(dev, count, f_pos);
+
+    no_room:
+    if ((retval == -ENOSPC) && (dev->overflow_policy == AESD_OVERFLOW_BLOCK))
     {
-        struct aesd_buffer_entry *old_entry = 
-            &dev->circ_buffer->entry[dev->circ_buffer->in_offs];
-        if (old_entry->buffptr != NULL)
+        /* Readers cannot run while the lock is held, no room event is missed */
+        room = atomic_read(&dev->room_events);
+        up_write(&dev->rw_lock);
+
+        if (filp->f_flags & O_NONBLOCK)
+        {
+            retval = -EAGAIN;
+            goto out;
+        }
+
+        atomic64_inc(&dev->stats.writes_blocked);
+        if (wait_event_interruptible(dev->write_queue, atomic_read(&dev->room_events) != room))
         {
-            /* Remove size of an old entry from file pointer offset */
-            dev->size -= old_entry->size;
-            *f_pos -= old_entry->size;
-            kfree((void *)old_entry->buffptr);
-            old_entry->buffptr = NULL;
-            old_entry->size = 0;
+            retval = -ERESTARTSYS;
+            goto out;
         }
+
+        /* The partial entry may have been completed meanwhile */
+        buf_offset = 0;
+        goto retry;
     }
 
-    /* Allocate memory for a new entry struct pointer */
-    new_entry = kmalloc(sizeof(struct aesd_buffer_entry), GFP_KERNEL);
-    if (!new_entry)
+    if (retval)
     {
-        retval = -ENOMEM;
-        PDEBUG("kmalloc failed for new_entry");
+        atomic64_inc(&dev->stats.writes_rejected);
+        PDEBUG("no room for %zu bytes without evicting unread entries", count);
         goto unlock;
     }
 
-    new_entry->size = count;
+    /* The ring copies the descriptor into its own slot */
+    new_entry.size = count;
     PDEBUG("-------------");
     PDEBUG("Requested write to aesd char device");
-    PDEBUG("new_entry->size = %zu bytes", new_entry->size);
+    PDEBUG("new_entry.size = %zu bytes", new_entry.size);
     PDEBUG("filp->f_pos %lld", filp->f_pos);
     PDEBUG("*f_pos = %lld", *f_pos);
     if (count == 0)
@@ -185,72 +379,120 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
         goto unlock;
     }
 
-    if (dev->write_entry_new_flag == FALSE)
+    if (dev->arena != NULL)
     {
-        /* Append new data to the existing entry */
-        dev->write_entry_new_flag = FALSE;
-        buf_offset = dev->circ_buffer->entry[dev->circ_buffer->in_offs].size;
-        new_entry->size = count + buf_offset;
-        new_entry->buffptr = kmalloc((sizeof(char) * (count + buf_offset)), GFP_KERNEL);
-        if (new_entry->buffptr <= 0)
+        /* Bytes go straight after the previous ones, evicting the oldest entries for room */
+        if (dev->write_entry_new_flag == FALSE)
         {
-            retval = -ENOMEM;
-            PDEBUG("kmalloc failed for new_entry->buffptr");
-                goto unlock;
+            buf_offset = dev->circ_buffer->entry[dev->circ_buffer->in_offs].size;
+        }
+
+        buffptr = aesd_arena_reserve(dev, count, f_pos);
+        if (IS_ERR(buffptr))
+        {
+            retval = PTR_ERR(buffptr);
+            PDEBUG("no arena room for an entry of %zu bytes: %zd", buf_offset + count, retval);
+            if (retval == -ENOSPC)
+            {
+                goto no_room;
+            }
+
+            atomic64_inc(&dev->stats.alloc_failures);
+            goto unlock;
         }
 
-        memcpy(new_entry->buffptr, 
-                dev->circ_buffer->entry[dev->circ_buffer->in_offs].buffptr, 
-                buf_offset);
-        kfree(dev->circ_buffer->entry[dev->circ_buffer->in_offs].buffptr);
-        dev->circ_buffer->entry[dev->circ_buffer->in_offs].buffptr = NULL;
-        dev->circ_buffer->entry[dev->circ_buffer->in_offs].size = 0;
+        capacity = buf_offset + count;
+    }
+    else if (dev->write_entry_new_flag == FALSE)
+    {
+        /* Append new data to the partial entry in place, growing its buffer
+         * geometrically so a packet built from many small writes costs
+         * amortized O(1) copies per byte */
+        partial_entry = &dev->circ_buffer->entry[dev->circ_buffer->in_offs];
+        buf_offset = partial_entry->size;
+        capacity = partial_entry->capacity;
+        buffptr = (char *)partial_entry->buffptr;
+        if ((buf_offset + count) > capacity)
+        {
+            buffptr = aesd_payload_alloc(max(capacity * 2, buf_offset + count), &capacity);
+            if (!buffptr)
+            {
+                /* The partial entry is left as it was */
+                retval = -ENOMEM;
+                atomic64_inc(&dev->stats.alloc_failures);
+                PDEBUG("aesd_payload_alloc failed for partial entry");
+                goto unlock;
+            }
+
+            /* Size classes live in different caches, move to the larger one */
+            memcpy(buffptr, partial_entry->buffptr, buf_offset);
+            aesd_payload_free(partial_entry->buffptr, partial_entry->capacity);
+            partial_entry->buffptr = buffptr;
+            partial_entry->capacity = capacity;
+        }
     }
     else /* dev->write_entry_new_flag == TRUE */
     {
         /* Don't append to existing entry */
-        new_entry->buffptr = kmalloc((sizeof(char) * count), GFP_KERNEL);
-        if (new_entry->buffptr <= 0)
+        buffptr = aesd_payload_alloc(count, &capacity);
+        if (!buffptr)
         {
             retval = -ENOMEM;
-            PDEBUG("kmalloc failed for new_entry->buffptr");
-                goto unlock;
+            atomic64_inc(&dev->stats.alloc_failures);
+            PDEBUG("aesd_payload_alloc failed for new_entry.buffptr");
+            goto unlock;
         }
     }
 
-    if (copy_from_user((const char*)(new_entry->buffptr + buf_offset), buf, count))
+    if (copy_from_iter(buffptr + buf_offset, count, from) != count)
     {
         retval = -EFAULT;
-        PDEBUG("copy_from_user failed for new_entry->buffptr");
-        kfree(new_entry->buffptr);
-        new_entry->buffptr = NULL;
+        PDEBUG("copy_from_iter failed for new_entry.buffptr");
+        if ((dev->arena == NULL) && (dev->write_entry_new_flag == TRUE))
+        {
+            aesd_payload_free(buffptr, capacity);
+        }
+
         goto unlock;
     }
 
+    new_entry.buffptr = buffptr;
+    new_entry.size = count + buf_offset;
+    new_entry.capacity = capacity;
+    slot = dev->circ_buffer->in_offs;
+    if (dev->arena != NULL)
+    {
+        dev->arena_tail = ((uint8_t *)buffptr - dev->arena) + new_entry.size;
+    }
+
     /* Check if entry is complete */
-    if (new_entry->buffptr[buf_offset + count - 1] != '\n')
+    if (new_entry.buffptr[buf_offset + count - 1] != '\n')
     {
         PDEBUG("Entry not complete, setting new flag to FALSE");
-        aesd_circular_buffer_add_entry(dev->circ_buffer, new_entry, FALSE, dev->write_entry_new_flag);
+        aesd_circular_buffer_add_entry(dev->circ_buffer, &new_entry, FALSE, dev->write_entry_new_flag);
         dev->write_entry_new_flag = FALSE;
     }
     else
     {
         PDEBUG("Entry complete, setting new flag to TRUE");
-        aesd_circular_buffer_add_entry(dev->circ_buffer, new_entry, TRUE, dev->write_entry_new_flag);
+        aesd_circular_buffer_add_entry(dev->circ_buffer, &new_entry, TRUE, dev->write_entry_new_flag);
         dev->write_entry_new_flag = TRUE;
+        WRITE_ONCE(dev->committed_pos, dev->circ_buffer->end_pos);
+        completed = true;
     }
 
     *f_pos += count; /* Update file position */
     dev->size += count; /* Update size of the device */
+    aesd_enforce_byte_budget(dev, f_pos);
+    aesd_mmap_publish(dev, slot, buf_offset, count);
     
     PDEBUG("--- WRITE IS DONE ----");
-    PDEBUG("aesd_write debug info:");
+    PDEBUG("aesd_write_iter debug info:");
     PDEBUG("dev->circ_buffer->in_offs %d", dev->circ_buffer->in_offs);
     PDEBUG("dev->circ_buffer->out_offs %d", dev->circ_buffer->out_offs);
     PDEBUG("dev->circ_buffer->full %d", dev->circ_buffer->full);
     PDEBUG("dev->write_entry_new_flag %d", dev->write_entry_new_flag);
-    PDEBUG("write added buf = %s", new_entry->buffptr);
+    PDEBUG("write added buf = %s", new_entry.buffptr);
     PDEBUG("write added %zu bytes to circular buffer", (count + buf_offset));
     PDEBUG("filp->f_pos %lld", filp->f_pos);
     PDEBUG("*f_pos %lld", *f_pos);
@@ -260,10 +502,25 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
     retval = count;
 
     unlock:
-    mutex_unlock(&dev->mutex_lock);
+    up_write(&dev->rw_lock);
     /* --------- EXIT CRITICAL SECTION ---------- */
-    
+
+    if (completed)
+    {
+        wake_up_interruptible(&dev->read_queue);
+        atomic64_inc(&dev->stats.entries_written);
+    }
+
+    account:
+    if (retval > 0)
+    {
+        atomic64_add(retval, &dev->stats.bytes_written);
+    }
+
+    aesd_record_latency(dev->stats.write_latency, start_ns);
+
     out:
+    trace_aesd_write_end(retval, *f_pos);
     return retval;
 }
 
@@ -272,6 +529,11 @@ loff_t aesd_llseek(struct file *filp, loff_t off, int whence)
     struct aesd_dev *dev = filp->private_data;
     loff_t newpos;
 
+    if (dev->stream_mode)
+    {
+        return -ESPIPE;
+    }
+
     PDEBUG("--------------");
     PDEBUG("aesd_llseek debug info:");
     PDEBUG("filp->f_pos %lld, off %lld, whence %d", filp->f_pos, off, whence);
@@ -295,6 +557,7 @@ loff_t aesd_llseek(struct file *filp, loff_t off, int whence)
     }
 
     filp->f_pos = newpos;
+    atomic64_inc(&dev->stats.seeks);
     PDEBUG("newpos %lld", newpos);
     PDEBUG("--------------");
     return newpos;
@@ -304,6 +567,10 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
     struct aesd_dev *dev = filp->private_data;
     struct aesd_seekto seekto;
+    struct aesd_ring_config ring_config;
+    struct aesd_entry_table entry_table;
+    struct aesd_seek_read seek_read;
+    struct aesd_overrun_info overrun;
     long retval = 0;
 
     PDEBUG("aesd_ioctl called with cmd %u", cmd);
@@ -314,6 +581,10 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
     if (_IOC_NR(cmd) > AESDCHAR_IOC_MAXNR)
         return -ENOTTY;
 
+    /* Every command addresses entries, a stream has none */
+    if (dev->stream_mode)
+        return -ENOTTY;
+
     switch (cmd) 
     {
         case AESDCHAR_IOCSEEKTO:
@@ -329,6 +600,78 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 
             break;
 
+        case AESDCHAR_IOCSRING:
+            if (copy_from_user(&ring_config, (const void __user *)arg, sizeof(ring_config)))
+            {
+                return -EFAULT;
+            }
+
+            PDEBUG("resize ring to %u entries, %llu bytes", ring_config.max_entries, ring_config.max_bytes);
+            retval = aesd_set_ring(dev, &ring_config);
+            break;
+
+        case AESDCHAR_IOCGRING:
+            memset(&ring_config, 0, sizeof(ring_config));
+            if (aesd_lock_read(dev))
+            {
+                return -ERESTARTSYS;
+            }
+
+            ring_config.max_entries = dev->circ_buffer->capacity;
+            ring_config.overflow_policy = dev->overflow_policy;
+            ring_config.max_bytes = dev->max_bytes;
+            up_read(&dev->rw_lock);
+
+            if (copy_to_user((void __user *)arg, &ring_config, sizeof(ring_config)))
+            {
+                return -EFAULT;
+            }
+
+            break;
+
+        case AESDCHAR_IOCGENTRIES:
+            if (copy_from_user(&entry_table, (const void __user *)arg, sizeof(entry_table)))
+            {
+                return -EFAULT;
+            }
+
+            retval = aesd_get_entries(dev, &entry_table);
+            if ((retval == 0) && copy_to_user((void __user *)arg, &entry_table, sizeof(entry_table)))
+            {
+                return -EFAULT;
+            }
+
+            break;
+
+        case AESDCHAR_IOCSEEKREAD:
+            if (copy_from_user(&seek_read, (const void __user *)arg, sizeof(seek_read)))
+            {
+                return -EFAULT;
+            }
+
+            PDEBUG("seek to write_cmd %u, offset %u and read %llu bytes",
+                    seek_read.write_cmd, seek_read.write_cmd_offset, seek_read.len);
+            retval = aesd_seek_read(filp, &seek_read);
+            if ((retval == 0) && copy_to_user((void __user *)arg, &seek_read, sizeof(seek_read)))
+            {
+                return -EFAULT;
+            }
+
+            break;
+
+        case AESDCHAR_IOCGOVERRUN:
+            memset(&overrun, 0, sizeof(overrun));
+            overrun.entries_lost = atomic64_read(&dev->stats.entries_lost);
+            overrun.bytes_lost = atomic64_read(&dev->stats.bytes_lost);
+            overrun.writes_rejected = atomic64_read(&dev->stats.writes_rejected);
+            overrun.writes_blocked = atomic64_read(&dev->stats.writes_blocked);
+            if (copy_to_user((void __user *)arg, &overrun, sizeof(overrun)))
+            {
+                return -EFAULT;
+            }
+
+            break;
+
         default:
             return -ENOTTY;
     }
@@ -336,14 +679,126 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
     return retval;
 }
 
+/*
+** Readable once a complete entry ends past the file position. Writable
+** when a one byte write finds room the way aesd_write_iter() would: slot,
+** byte budget and arena, evicting only what the overflow policy allows.
+*/
+__poll_t aesd_poll(struct file *filp, poll_table *wait)
+{
+    struct aesd_dev *dev = filp->private_data;
+    struct aesd_circular_buffer *buffer = dev->circ_buffer;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+    size_t position;
+
+    if (dev->stream_mode)
+    {
+        return aesd_stream_poll(dev, filp, wait);
+    }
+
+    poll_wait(filp, &dev->read_queue, wait);
+    poll_wait(filp, &dev->write_queue, wait);
+
+    if (aesd_lock_read(dev))
+    {
+        return mask;
+    }
+
+    if (!aesd_write_has_room(dev, 1))
+    {
+        mask = 0;
+    }
+
+    position = buffer->base_pos + ((filp->f_pos > 0) ? filp->f_pos : 0);
+    if (dev->committed_pos > position)
+    {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+
+    up_read(&dev->rw_lock);
+    return mask;
+}
+
+static void aesd_vma_open(struct vm_area_struct *vma)
+{
+    struct aesd_dev *dev = vma->vm_private_data;
+
+    atomic_inc(&dev->mmap_count);
+}
+
+static void aesd_vma_close(struct vm_area_struct *vma)
+{
+    struct aesd_dev *dev = vma->vm_private_data;
+
+    atomic_dec(&dev->mmap_count);
+}
+
+static const struct vm_operations_struct aesd_vm_ops = {
+    .open =     aesd_vma_open,
+    .close =    aesd_vma_close,
+};
+
+/*
+** Maps the header and arena read-only, see struct aesd_mmap_header
+**
+** Called with the mm's mmap_lock held for writing. rw_lock is held
+** across user copies that may fault and take that lock, so only
+** dev->mmap_lock is taken here.
+*/
+int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct aesd_dev *dev = filp->private_data;
+    int retval = 0;
+
+    if (vma->vm_flags & VM_WRITE)
+    {
+        return -EPERM;
+    }
+
+    mutex_lock(&dev->mmap_lock);
+
+    if (dev->mmap_area == NULL)
+    {
+        retval = -ENODEV;
+        goto unlock;
+    }
+
+    retval = remap_vmalloc_range(vma, dev->mmap_area, vma->vm_pgoff);
+    if (retval)
+    {
+        goto unlock;
+    }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+    vma->vm_ops = &aesd_vm_ops;
+    vma->vm_private_data = dev;
+    aesd_vma_open(vma);
+
+    unlock:
+    mutex_unlock(&dev->mmap_lock);
+    return retval;
+}
+
 struct file_operations aesd_fops = {
     .owner =    THIS_MODULE,
-    .read =     aesd_read,
-    .write =    aesd_write,
+    .read_iter =    aesd_read_iter,
+    .write_iter =   aesd_write_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read =  copy_splice_read,
+#else
+    .splice_read =  generic_file_splice_read,
+#endif
+    .splice_write = iter_file_splice_write,
     .open =     aesd_open,
     .release =  aesd_release,
     .unlocked_ioctl = aesd_ioctl,
     .llseek =   aesd_llseek,
+    .mmap =     aesd_mmap,
+    .poll =     aesd_poll,
 };
 
 /*
@@ -354,131 +809,995 @@ struct file_operations aesd_fops = {
 */
 static long aesd_adjust_file_offset(struct file *filp, uint32_t write_cmd, uint32_t write_cmd_offset)
 {
-    long retval = 0;
     long offset = 0;
     struct aesd_dev *dev = filp->private_data;
 
-    if (write_cmd >= (AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - 1))
-    {
-        PDEBUG("write_cmd %u is out of bounds", write_cmd);
-        return -EINVAL;
-    }
-
     /* --------- ENTER CRITICAL SECTION ---------- */
-    if (mutex_lock_interruptible(&dev->mutex_lock))
+    if (aesd_lock_read(dev))
     {
-		retval = -ERESTARTSYS;
+		offset = -ERESTARTSYS;
         goto out;
     }
-    
+
     offset = aesd_buffer_find_offset(dev->circ_buffer, write_cmd, write_cmd_offset);
     if (offset < 0)
     {
         PDEBUG("aesd_buffer_find_offset failed, incorrect write_cmd_offset %u for write_cmd %u",
                 write_cmd_offset, write_cmd);
-        retval = -EINVAL;
+        offset = -EINVAL;
         goto unlock;
     }
 
     PDEBUG("aesd_adjust_file_offset: final buffer offset %ld", offset);
     filp->f_pos = offset;
+    atomic64_inc(&dev->stats.seeks);
 
     unlock:
-    mutex_unlock(&dev->mutex_lock);
+    up_read(&dev->rw_lock);
     /* --------- EXIT CRITICAL SECTION ---------- */
 
     out:
+    trace_aesd_adjust_file_offset(write_cmd, write_cmd_offset, offset);
     return offset;
 }
 
 
-static int aesd_setup_cdev(struct aesd_dev *dev)
+/*
+** Copies the descriptors of the held entries, oldest first, to the user
+** table and sets table->count to the number held.
+** Returns: 0 on success, -ERESTARTSYS or -EFAULT otherwise
+*/
+static long aesd_get_entries(struct aesd_dev *dev, struct aesd_entry_table *table)
 {
-    int err, devno = MKDEV(aesd_major, aesd_minor);
+    struct aesd_entry_info __user *out = u64_to_user_ptr(table->entries);
+    struct aesd_circular_buffer *buffer = dev->circ_buffer;
+    struct aesd_buffer_entry *entry;
+    struct aesd_entry_info info;
+    uint32_t used;
+    uint32_t index;
+    long retval = 0;
 
-    cdev_init(&dev->cdev, &aesd_fops);
-    dev->cdev.owner = THIS_MODULE;
-    dev->cdev.ops = &aesd_fops;
-    err = cdev_add (&dev->cdev, devno, 1);
-    if (err) {
-        printk(KERN_ERR "Error %d adding aesd cdev", err);
+    /* --------- ENTER CRITICAL SECTION ---------- */
+    if (aesd_lock_read(dev))
+    {
+        return -ERESTARTSYS;
     }
-    return err;
-}
-
 
-int aesd_init_module(void)
-{
-    dev_t dev = 0;
-    int result;
+    used = aesd_circular_buffer_used(buffer);
+    for (index = 0; (index < used) && (index < table->max_entries); index++)
+    {
+        entry = &buffer->entry[(buffer->out_offs + index) % buffer->capacity];
+        memset(&info, 0, sizeof(info));
+        info.seq = entry->seq;
+        info.offset = entry->start - buffer->base_pos;
+        info.size = entry->size;
+        if ((index == (used - 1)) && (dev->write_entry_new_flag == FALSE))
+        {
+            info.flags = AESD_ENTRY_PARTIAL;
+        }
 
-    PDEBUG("aesdchar module init");
-    result = alloc_chrdev_region(&dev, aesd_minor, 1,
-            "aesdchar");
-    aesd_major = MAJOR(dev);
-    if (result < 0) {
-        printk(KERN_WARNING "Can't get major %d\n", aesd_major);
-        return result;
+        if (copy_to_user(&out[index], &info, sizeof(info)))
+        {
+            retval = -EFAULT;
+            break;
+        }
     }
 
-    aesd_device = kmalloc(sizeof(struct aesd_dev), GFP_KERNEL);
-    if (!aesd_device) {
-        result = -ENOMEM;
-        printk(KERN_ERR "kmalloc failed for aesd_device");
-        goto fail;
+    table->count = used;
+    up_read(&dev->rw_lock);
+    /* --------- EXIT CRITICAL SECTION ---------- */
+
+    return retval;
+}
+
+/*
+** Seeks to the entry and offset of request, then reads up to request->len
+** bytes from there to request->buf under the same lock, so no writer can
+** evict what was just located. request->len is set to the bytes read.
+** Returns: 0 on success, -ERESTARTSYS, -EINVAL or -EFAULT otherwise
+*/
+static long aesd_seek_read(struct file *filp, struct aesd_seek_read *request)
+{
+    struct aesd_dev *dev = filp->private_data;
+    struct iovec iov;
+    struct iov_iter to;
+    loff_t position;
+    long offset;
+    ssize_t copied;
+
+    iov.iov_base = u64_to_user_ptr(request->buf);
+    iov.iov_len = min_t(u64, request->len, MAX_RW_COUNT);
+    iov_iter_init(&to, READ, &iov, 1, iov.iov_len);
+
+    /* --------- ENTER CRITICAL SECTION ---------- */
+    if (aesd_lock_read(dev))
+    {
+        return -ERESTARTSYS;
+    }
+
+    offset = aesd_buffer_find_offset(dev->circ_buffer, request->write_cmd, request->write_cmd_offset);
+    if (offset < 0)
+    {
+        up_read(&dev->rw_lock);
+        return -EINVAL;
+    }
+
+    position = offset;
+    copied = aesd_copy_to_iter(dev, &position, &to);
+    if (copied > 0)
+    {
+        aesd_mark_consumed(dev, dev->circ_buffer->base_pos + position);
+    }
+
+    up_read(&dev->rw_lock);
+    /* --------- EXIT CRITICAL SECTION ---------- */
+
+    if (copied < 0)
+    {
+        return copied;
+    }
+
+    filp->f_pos = position;
+    request->len = copied;
+    atomic64_inc(&dev->stats.seeks);
+    atomic64_inc(&dev->stats.reads);
+    atomic64_add(copied, &dev->stats.bytes_read);
+    return 0;
+}
+
+/*
+** Takes dev->rw_lock shared, counting contention and the time spent waiting.
+** Returns: 0 with the lock held, -EINTR if killed while waiting
+*/
+static int aesd_lock_read(struct aesd_dev *dev)
+{
+    u64 start_ns;
+    int retval;
+
+    if (down_read_trylock(&dev->rw_lock))
+    {
+        return 0;
+    }
+
+    start_ns = ktime_get_ns();
+    retval = down_read_killable(&dev->rw_lock);
+    atomic64_inc(&dev->stats.read_lock_contended);
+    atomic64_add(ktime_get_ns() - start_ns, &dev->stats.read_lock_wait_ns);
+    return retval;
+}
+
+/*
+** Exclusive counterpart of aesd_lock_read()
+*/
+static int aesd_lock_write(struct aesd_dev *dev)
+{
+    u64 start_ns;
+    int retval;
+
+    if (down_write_trylock(&dev->rw_lock))
+    {
+        return 0;
+    }
+
+    start_ns = ktime_get_ns();
+    retval = down_write_killable(&dev->rw_lock);
+    atomic64_inc(&dev->stats.write_lock_contended);
+    atomic64_add(ktime_get_ns() - start_ns, &dev->stats.write_lock_wait_ns);
+    return retval;
+}
+
+/*
+** Counts one call that started at start_ns in its log2 bucket
+*/
+static void aesd_record_latency(atomic64_t *histogram, u64 start_ns)
+{
+    u64 elapsed_ns = ktime_get_ns() - start_ns;
+    uint32_t bucket = (elapsed_ns > 1) ? ilog2(elapsed_ns) : 0;
+
+    atomic64_inc(&histogram[min(bucket, (uint32_t)(AESD_LATENCY_BUCKETS - 1))]);
+}
+
+static void aesd_stats_show_histogram(struct seq_file *s, const char *name, atomic64_t *histogram)
+{
+    uint32_t bucket;
+    s64 calls;
+
+    seq_printf(s, "%s:\n", name);
+    for (bucket = 0; bucket < AESD_LATENCY_BUCKETS; bucket++)
+    {
+        calls = atomic64_read(&histogram[bucket]);
+        if (calls != 0)
+        {
+            seq_printf(s, "  >= %llu ns: %lld\n", 1ULL << bucket, calls);
+        }
+    }
+}
+
+static int aesd_stats_show(struct seq_file *s, void *unused)
+{
+    struct aesd_dev *dev = s->private;
+    struct aesd_stats *stats = &dev->stats;
+
+    seq_printf(s, "bytes_written: %lld\n", atomic64_read(&stats->bytes_written));
+    seq_printf(s, "entries_written: %lld\n", atomic64_read(&stats->entries_written));
+    seq_printf(s, "entries_evicted: %lld\n", atomic64_read(&stats->entries_evicted));
+    seq_printf(s, "bytes_evicted: %lld\n", atomic64_read(&stats->bytes_evicted));
+    seq_printf(s, "reads: %lld\n", atomic64_read(&stats->reads));
+    seq_printf(s, "bytes_read: %lld\n", atomic64_read(&stats->bytes_read));
+    seq_printf(s, "seeks: %lld\n", atomic64_read(&stats->seeks));
+    seq_printf(s, "alloc_failures: %lld\n", atomic64_read(&stats->alloc_failures));
+    seq_printf(s, "entries_lost: %lld\n", atomic64_read(&stats->entries_lost));
+    seq_printf(s, "bytes_lost: %lld\n", atomic64_read(&stats->bytes_lost));
+    seq_printf(s, "writes_rejected: %lld\n", atomic64_read(&stats->writes_rejected));
+    seq_printf(s, "writes_blocked: %lld\n", atomic64_read(&stats->writes_blocked));
+    seq_printf(s, "read_lock_contended: %lld\n", atomic64_read(&stats->read_lock_contended));
+    seq_printf(s, "read_lock_wait_ns: %lld\n", atomic64_read(&stats->read_lock_wait_ns));
+    seq_printf(s, "write_lock_contended: %lld\n", atomic64_read(&stats->write_lock_contended));
+    seq_printf(s, "write_lock_wait_ns: %lld\n", atomic64_read(&stats->write_lock_wait_ns));
+    aesd_stats_show_histogram(s, "read_latency", stats->read_latency);
+    aesd_stats_show_histogram(s, "write_latency", stats->write_latency);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(aesd_stats);
+
+/*
+** Frees the oldest complete entry of the ring, the writer's file position
+** moves back with the data. Caller holds dev->rw_lock for writing.
+**
+** Returns: false if there was no complete entry to evict
+*/
+static bool aesd_evict_oldest(struct aesd_dev *dev, loff_t *f_pos)
+{
+    struct aesd_buffer_entry old_entry;
+
+    if (!aesd_circular_buffer_remove_oldest(dev->circ_buffer, &old_entry))
+    {
+        return false;
+    }
+
+    trace_aesd_evict(old_entry.size, dev->size);
+    atomic64_inc(&dev->stats.entries_evicted);
+    atomic64_add(old_entry.size, &dev->stats.bytes_evicted);
+    if ((old_entry.start + old_entry.size) > READ_ONCE(dev->consumed_pos))
+    {
+        atomic64_inc(&dev->stats.entries_lost);
+        atomic64_add(old_entry.size, &dev->stats.bytes_lost);
+    }
+
+    /* Remove size of an old entry from file pointer offset */
+    dev->size -= old_entry.size;
+    if (f_pos != NULL)
+    {
+        *f_pos -= old_entry.size;
+    }
+
+    /* Arena space is reclaimed by the next aesd_arena_reserve() */
+    if (dev->arena == NULL)
+    {
+        aesd_payload_free(old_entry.buffptr, old_entry.capacity);
+    }
+
+    return true;
+}
+
+/*
+** Finds arena space for count more bytes of the entry being written.
+** Entries are kept contiguous: a new entry starts at the tail or, if it
+** does not fit before the end of the arena, at offset 0. A partial entry
+** grows in place or is moved to offset 0 the same way. Oldest complete
+** entries are evicted until the space is free. Caller holds dev->rw_lock
+** for writing.
+**
+** Returns: start of the entry (the partial one possibly moved), the new
+** bytes go after its current size. ERR_PTR(-EFBIG) if the entry exceeds
+** the arena, ERR_PTR(-ENOSPC) if the overflow policy keeps an unread entry.
+*/
+static char *aesd_arena_reserve(struct aesd_dev *dev, size_t count, loff_t *f_pos)
+{
+    struct aesd_circular_buffer *buffer = dev->circ_buffer;
+    struct aesd_buffer_entry *partial = NULL;
+    size_t size = count;
+    size_t start;
+
+    if (dev->write_entry_new_flag == FALSE)
+    {
+        partial = &buffer->entry[buffer->in_offs];
+        size += partial->size;
+    }
+
+    if (size > dev->arena_size)
+    {
+        return ERR_PTR(-EFBIG);
+    }
+
+    while (!aesd_arena_place(dev, 0, size, &start))
+    {
+        if (!aesd_evict_for_write(dev, f_pos))
+        {
+            return ERR_PTR(-ENOSPC);
+        }
+    }
+
+    if ((partial != NULL) && ((dev->arena + start) != (uint8_t *)partial->buffptr))
+    {
+        /* Wrap the partial entry, it may overlap its new place when alone */
+        memmove(dev->arena + start, partial->buffptr, partial->size);
+        partial->buffptr = (char *)(dev->arena + start);
+        dev->arena_tail = start + partial->size;
+    }
+
+    return (char *)(dev->arena + start);
+}
+
+/*
+** Places an entry of size bytes (the partial one included) in the arena as
+** if the gone oldest complete entries were already evicted. Caller holds
+** dev->rw_lock.
+**
+** Returns: true and the arena offset in start if the entry fits, false if
+** more entries must be evicted first
+*/
+static bool aesd_arena_place(struct aesd_dev *dev, uint32_t gone, size_t size, size_t *start)
+{
+    struct aesd_circular_buffer *buffer = dev->circ_buffer;
+    struct aesd_buffer_entry *partial = NULL;
+    size_t head;
+
+    if (dev->write_entry_new_flag == FALSE)
+    {
+        partial = &buffer->entry[buffer->in_offs];
+    }
+
+    *start = (partial != NULL) ? ((uint8_t *)partial->buffptr - dev->arena) : dev->arena_tail;
+    if (aesd_circular_buffer_count(buffer) <= gone)
+    {
+        /* Nothing to evict, only the partial entry (if any) is live */
+        if ((partial == NULL) || ((*start + size) > dev->arena_size))
+        {
+            *start = 0;
+        }
+
+        return true;
+    }
+
+    /* Live bytes run from the oldest complete entry to the tail, possibly wrapped */
+    head = (uint8_t *)buffer->entry[(buffer->out_offs + gone) % buffer->capacity].buffptr - dev->arena;
+    if (head < *start)
+    {
+        if ((*start + size) <= dev->arena_size)
+        {
+            return true;
+        }
+
+        if (size <= head)
+        {
+            *start = 0;
+            return true;
+        }
+    }
+    else if ((*start + size) <= head)
+    {
+        return true;
+    }
+
+    return false;
+}
+
+/*
+** Evicts the oldest complete entry if the overflow policy allows it: always
+** with AESD_OVERFLOW_OVERWRITE, otherwise only once a reader has read it.
+** Caller holds dev->rw_lock for writing.
+** Returns: true if an entry was evicted
+*/
+static bool aesd_evict_for_write(struct aesd_dev *dev, loff_t *f_pos)
+{
+    struct aesd_circular_buffer *buffer = dev->circ_buffer;
+    struct aesd_buffer_entry *oldest;
+
+    if (aesd_circular_buffer_count(buffer) == 0)
+    {
+        return false;
+    }
+
+    oldest = &buffer->entry[buffer->out_offs];
+    if ((dev->overflow_policy != AESD_OVERFLOW_OVERWRITE) &&
+            ((oldest->start + oldest->size) > READ_ONCE(dev->consumed_pos)))
+    {
+        return false;
+    }
+
+    return aesd_evict_oldest(dev, f_pos);
+}
+
+/*
+** Evicts what a write of count bytes displaces before anything is written:
+** the oldest entry if a new one needs its slot and, unless overwriting,
+** the entries over the byte budget (overwriting trims after the write).
+** Caller holds dev->rw_lock for writing.
+** Returns: 0, or -ENOSPC if the overflow policy keeps an unread entry
+*/
+static int aesd_make_room(struct aesd_dev *dev, size_t count, loff_t *f_pos)
+{
+    struct aesd_circular_buffer *buffer = dev->circ_buffer;
+
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    /* Nothing is evicted for a write that cannot complete, poll() asks the same */
+    if (!aesd_write_has_room(dev, count))
+    {
+        return -ENOSPC;
+    }
+
+    if ((buffer->full == true) && (dev->write_entry_new_flag == TRUE) && !aesd_evict_for_write(dev, f_pos))
+    {
+        return -ENOSPC;
+    }
+
+    if ((dev->overflow_policy == AESD_OVERFLOW_OVERWRITE) || (dev->max_bytes == 0))
+    {
+        return 0;
+    }
+
+    while (((dev->size + count) > dev->max_bytes) && (aesd_circular_buffer_count(buffer) > 0))
+    {
+        if (!aesd_evict_for_write(dev, f_pos))
+        {
+            return -ENOSPC;
+        }
+    }
+
+    return 0;
+}
+
+/*
+** Dry run of the evictions a write of count bytes needs: the slot and byte
+** budget of aesd_make_room(), then the arena space of aesd_arena_reserve().
+** Under a lossless overflow policy only the read prefix of the ring may be
+** evicted. Nothing is changed, caller holds dev->rw_lock (shared is enough).
+**
+** Returns: true if the write would not block or fail with -ENOSPC
+*/
+static bool aesd_write_has_room(struct aesd_dev *dev, size_t count)
+{
+    struct aesd_circular_buffer *buffer = dev->circ_buffer;
+    uint32_t entries = aesd_circular_buffer_count(buffer);
+    size_t consumed = READ_ONCE(dev->consumed_pos);
+    size_t size = dev->size;
+    size_t entry_size = count;
+    uint32_t evictable = 0;
+    uint32_t gone = 0;
+    struct aesd_buffer_entry *entry;
+    size_t start;
+
+    if ((count == 0) || (dev->overflow_policy == AESD_OVERFLOW_OVERWRITE))
+    {
+        return true;
+    }
+
+    /* Readers consume in stream order, the read entries are the oldest ones */
+    while (evictable < entries)
+    {
+        entry = &buffer->entry[(buffer->out_offs + evictable) % buffer->capacity];
+        if ((entry->start + entry->size) > consumed)
+        {
+            break;
+        }
+
+        evictable++;
+    }
+
+    if ((buffer->full == true) && (dev->write_entry_new_flag == TRUE))
+    {
+        if (gone == evictable)
+        {
+            return false;
+        }
+
+        size -= buffer->entry[buffer->out_offs].size;
+        gone++;
+    }
+
+    if (dev->max_bytes != 0)
+    {
+        while (((size + count) > dev->max_bytes) && (gone < entries))
+        {
+            if (gone == evictable)
+            {
+                return false;
+            }
+
+            size -= buffer->entry[(buffer->out_offs + gone) % buffer->capacity].size;
+            gone++;
+        }
+    }
+
+    if (dev->arena == NULL)
+    {
+        return true;
     }
 
-    memset(aesd_device,0,sizeof(struct aesd_dev));
+    if (dev->write_entry_new_flag == FALSE)
+    {
+        entry_size += buffer->entry[buffer->in_offs].size;
+    }
+
+    if (entry_size > dev->arena_size)
+    {
+        /* aesd_arena_reserve() fails with -EFBIG, the write does not wait */
+        return true;
+    }
+
+    while (!aesd_arena_place(dev, gone, entry_size, &start))
+    {
+        if (gone == evictable)
+        {
+            return false;
+        }
+
+        gone++;
+    }
+
+    return true;
+}
+
+/*
+** Records that a reader read up to stream position and wakes writers
+** waiting for room. Called with dev->rw_lock held shared, so concurrent
+** readers race on consumed_pos and only ever move it forward.
+*/
+static void aesd_mark_consumed(struct aesd_dev *dev, size_t position)
+{
+    size_t consumed = READ_ONCE(dev->consumed_pos);
+    size_t previous;
+
+    while (position > consumed)
+    {
+        previous = cmpxchg(&dev->consumed_pos, consumed, position);
+        if (previous == consumed)
+        {
+            atomic_inc(&dev->room_events);
+            if (wq_has_sleeper(&dev->write_queue))
+            {
+                wake_up_interruptible(&dev->write_queue);
+            }
+
+            break;
+        }
+
+        consumed = previous;
+    }
+}
+
+/*
+** Evicts the oldest complete entries while the device holds more than
+** dev->max_bytes, within the overflow policy. The partial entry being
+** written is never evicted.
+** Caller holds dev->rw_lock for writing.
+*/
+static void aesd_enforce_byte_budget(struct aesd_dev *dev, loff_t *f_pos)
+{
+    if (dev->max_bytes == 0)
+    {
+        return;
+    }
+
+    while ((dev->size > dev->max_bytes) && aesd_evict_for_write(dev, f_pos))
+    {
+    }
+}
+
+/*
+** Applies new ring limits, entries that no longer fit are evicted oldest
+** first and the ring storage is reallocated to config->max_entries.
+**
+** Returns: 0 on success, negative error code on failure
+*/
+static long aesd_set_ring(struct aesd_dev *dev, const struct aesd_ring_config *config)
+{
+    long retval = 0;
+    struct aesd_circular_buffer *buffer = dev->circ_buffer;
+    uint32_t old_capacity;
+    uint32_t used;
+
+    if ((config->max_entries == 0) || (config->max_entries > AESDCHAR_MAX_ENTRIES_LIMIT) ||
+            (config->overflow_policy > AESD_OVERFLOW_MAX))
+    {
+        return -EINVAL;
+    }
+
+    /* --------- ENTER CRITICAL SECTION ---------- */
+    if (aesd_lock_write(dev))
+    {
+        return -ERESTARTSYS;
+    }
+
+    /* Mapped readers index entries[] by slot, it cannot move under them.
+     * mmap_lock keeps new mappings out until the area is reallocated. */
+    mutex_lock(&dev->mmap_lock);
+    if ((config->max_entries != buffer->capacity) && (atomic_read(&dev->mmap_count) > 0))
+    {
+        retval = -EBUSY;
+        goto unlock;
+    }
+
+    old_capacity = buffer->capacity;
+
+    /* The partial entry (no newline yet) needs a slot of its own */
+    used = aesd_circular_buffer_count(buffer) + (dev->write_entry_new_flag == FALSE ? 1 : 0);
+    while ((used > config->max_entries) && aesd_evict_oldest(dev, NULL))
+    {
+        used--;
+    }
+
+    retval = aesd_circular_buffer_resize(buffer, config->max_entries);
+    if (retval == 0)
+    {
+        dev->overflow_policy = config->overflow_policy;
+        dev->max_bytes = config->max_bytes;
+        aesd_enforce_byte_budget(dev, NULL);
+
+        /* Blocked writers retry against the new limits and policy */
+        atomic_inc(&dev->room_events);
+        wake_up_interruptible(&dev->write_queue);
+
+        if ((dev->mmap_area != NULL) && (config->max_entries != old_capacity))
+        {
+            /* Not mapped, the entry table is reallocated for the new capacity */
+            retval = aesd_mmap_alloc(dev);
+        }
+        else
+        {
+            aesd_mmap_publish(dev, U32_MAX, 0, 0);
+        }
+    }
 
-    /**
-     * TODO: initialize the AESD specific portion of the device
-     */
+    unlock:
+    mutex_unlock(&dev->mmap_lock);
+    up_write(&dev->rw_lock);
+    /* --------- EXIT CRITICAL SECTION ---------- */
 
-    aesd_device->circ_buffer = kmalloc(sizeof(struct aesd_circular_buffer), GFP_KERNEL);
-    memset(aesd_device->circ_buffer, 0, sizeof(struct aesd_circular_buffer));
-    aesd_circular_buffer_init(aesd_device->circ_buffer);
-    aesd_device->write_entry_new_flag = TRUE;
-    mutex_init(&aesd_device->mutex_lock);
+    return retval;
+}
 
-    result = aesd_setup_cdev(aesd_device);
+/*
+** Updates the header from the ring and copies count bytes written at
+** offset into entry slot to the arena, slot U32_MAX rebuilds the whole
+** entry table and copies nothing. Caller holds dev->rw_lock for writing.
+**
+** The mapped arena is a deliberate copy rather than the ring's own pages:
+** entries live in kmalloc'ed payloads or, with an arena, move to offset 0
+** when they wrap and get reused on eviction, while mapped readers address
+** bytes by stream position (position % arena_size) under the generation
+** count. A write copies only its own appended bytes and one table slot.
+*/
+static void aesd_mmap_publish(struct aesd_dev *dev, uint32_t slot, size_t offset, size_t count)
+{
+    struct aesd_mmap_header *header = dev->mmap_header;
+    struct aesd_circular_buffer *buffer = dev->circ_buffer;
+    struct aesd_buffer_entry *entry;
+    uint64_t position;
+    size_t arena_offset;
+    size_t span;
+    uint32_t index;
 
-    if( result )
+    if (header == NULL)
     {
-        unregister_chrdev_region(dev, 1);
+        return;
     }
+
+    WRITE_ONCE(header->generation, header->generation + 1);
+    smp_wmb();
+
+    if (slot < buffer->capacity)
+    {
+        entry = &buffer->entry[slot];
+        if (entry->buffptr != NULL)
+        {
+            /* Only the newest arena_size bytes fit */
+            if (count > header->arena_size)
+            {
+                offset += count - header->arena_size;
+                count = header->arena_size;
+            }
+
+            position = entry->start + offset;
+            while (count > 0)
+            {
+                arena_offset = position % header->arena_size;
+                span = min(count, (size_t)(header->arena_size - arena_offset));
+                memcpy(dev->mmap_arena + arena_offset, entry->buffptr + offset, span);
+                position += span;
+                offset += span;
+                count -= span;
+            }
+
+            header->entries[slot].start = entry->start;
+            header->entries[slot].size = entry->size;
+        }
+    }
+    else
+    {
+        /* Full rebuild of the entry table */
+        for (index = 0; index < buffer->capacity; index++)
+        {
+            header->entries[index].start = buffer->entry[index].start;
+            header->entries[index].size = buffer->entry[index].size;
+        }
+    }
+
+    header->first_slot = buffer->out_offs;
+    header->entry_count = aesd_circular_buffer_used(buffer);
+    header->base_pos = buffer->base_pos;
+    header->end_pos = buffer->end_pos;
+
+    smp_wmb();
+    WRITE_ONCE(header->generation, header->generation + 1);
+}
+
+/*
+** (Re)allocates the mapped area for the current ring capacity. Arena
+** contents are carried over. Caller holds dev->rw_lock for writing and
+** dev->mmap_lock, or is module init.
+**
+** Returns: 0 on success, -ENOMEM after which mmap support is off
+*/
+static int aesd_mmap_alloc(struct aesd_dev *dev)
+{
+    size_t header_size = PAGE_ALIGN(sizeof(struct aesd_mmap_header) +
+            (dev->circ_buffer->capacity * sizeof(struct aesd_mmap_entry)));
+    size_t arena_size = PAGE_ALIGN(aesd_mmap_bytes);
+    void *area;
+    struct aesd_mmap_header *header;
+
+    area = vmalloc_user(header_size + arena_size);
+    if (!area)
+    {
+        /* The old entry table no longer matches the ring */
+        vfree(dev->mmap_area);
+        dev->mmap_area = NULL;
+        dev->mmap_header = NULL;
+        dev->mmap_arena = NULL;
+        dev->mmap_size = 0;
+        return -ENOMEM;
+    }
+
+    header = area;
+    header->magic = AESD_MMAP_MAGIC;
+    header->version = AESD_MMAP_VERSION;
+    header->capacity = dev->circ_buffer->capacity;
+    header->arena_offset = header_size;
+    header->arena_size = arena_size;
+
+    if (dev->mmap_area != NULL)
+    {
+        header->generation = dev->mmap_header->generation;
+        memcpy((uint8_t *)area + header_size, dev->mmap_arena, arena_size);
+        vfree(dev->mmap_area);
+    }
+
+    dev->mmap_area = area;
+    dev->mmap_size = header_size + arena_size;
+    dev->mmap_header = header;
+    dev->mmap_arena = (uint8_t *)area + header_size;
+    aesd_mmap_publish(dev, U32_MAX, 0, 0);
+    return 0;
+}
+
+static int aesd_setup_cdev(struct aesd_dev *dev, unsigned int index)
+{
+    int err, devno = MKDEV(aesd_major, aesd_minor + index);
+
+    cdev_init(&dev->cdev, &aesd_fops);
+    dev->cdev.owner = THIS_MODULE;
+    dev->cdev.ops = &aesd_fops;
+    err = cdev_add (&dev->cdev, devno, 1);
+    if (err) {
+        printk(KERN_ERR "Error %d adding aesd cdev %u", err, index);
+    }
+    return err;
+}
+
+/*
+** Frees everything a device holds, also a partially set up one.
+** Its cdev must already be removed.
+*/
+static void aesd_teardown_device(struct aesd_dev *dev)
+{
+    uint32_t index = 0U;
+    struct aesd_buffer_entry *entry;
+
+    if (dev->circ_buffer != NULL)
+    {
+        AESD_CIRCULAR_BUFFER_FOREACH(entry, dev->circ_buffer, index)
+        {
+            if (dev->arena == NULL)
+            {
+                aesd_payload_free(entry->buffptr, entry->capacity);
+            }
+
+            entry->buffptr = NULL;
+        }
+
+        aesd_circular_buffer_destroy(dev->circ_buffer);
+        kfree(dev->circ_buffer);
+        dev->circ_buffer = NULL;
+    }
+
+    vfree(dev->mmap_area);
+    dev->mmap_area = NULL;
+    vfree(dev->arena);
+    dev->arena = NULL;
+    debugfs_remove_recursive(dev->debugfs_dir);
+    dev->debugfs_dir = NULL;
+    aesd_stream_free(dev);
+}
+
+/*
+** Sets up the ring, mmap arena and cdev of the device for minor index.
+** Returns: 0 on success, negative errno otherwise with nothing left to free
+** but the device itself.
+*/
+static int aesd_setup_device(struct aesd_dev *dev, unsigned int index)
+{
+    int result;
+    char name[16];
+
+    dev->circ_buffer = kmalloc(sizeof(struct aesd_circular_buffer), GFP_KERNEL);
+    if (!dev->circ_buffer) {
+        printk(KERN_ERR "kmalloc failed for circ_buffer");
+        return -ENOMEM;
+    }
+
+    result = aesd_circular_buffer_init(dev->circ_buffer, aesd_max_entries);
+    if (result) {
+        printk(KERN_ERR "aesd_max_entries %u is invalid or could not be allocated", aesd_max_entries);
+        kfree(dev->circ_buffer);
+        dev->circ_buffer = NULL;
+        return result;
+    }
+
+    dev->max_bytes = aesd_max_bytes;
+    dev->overflow_policy = aesd_overflow_policy;
+    dev->write_entry_new_flag = TRUE;
+    atomic_set(&dev->mmap_count, 0);
+    mutex_init(&dev->mmap_lock);
+    atomic_set(&dev->room_events, 0);
+    init_waitqueue_head(&dev->read_queue);
+    init_waitqueue_head(&dev->write_queue);
+    if ((index < 64) && (aesd_stream_mask & (1ULL << index))) {
+        /* The ring stays allocated but unused, no arena or mmap area */
+        result = aesd_stream_init(dev, aesd_stream_bytes);
+        if (result) {
+            printk(KERN_ERR "kfifo_alloc failed for a %lu bytes stream", aesd_stream_bytes);
+            goto fail;
+        }
+    }
+
+    if ((aesd_arena_bytes != 0) && !dev->stream_mode) {
+        dev->arena_size = PAGE_ALIGN(aesd_arena_bytes);
+        dev->arena = vmalloc(dev->arena_size);
+        if (!dev->arena) {
+            result = -ENOMEM;
+            printk(KERN_ERR "vmalloc failed for a %zu bytes payload arena", dev->arena_size);
+            goto fail;
+        }
+    }
+
+    if ((aesd_mmap_bytes != 0) && !dev->stream_mode) {
+        result = aesd_mmap_alloc(dev);
+        if (result) {
+            printk(KERN_ERR "vmalloc_user failed for a %lu bytes mmap arena", aesd_mmap_bytes);
+            goto fail;
+        }
+    }
+
+    init_rwsem(&dev->rw_lock);
+
+    snprintf(name, sizeof(name), "dev%u", index);
+    dev->debugfs_dir = debugfs_create_dir(name, aesd_debugfs_dir);
+    debugfs_create_file("stats", 0444, dev->debugfs_dir, dev, &aesd_stats_fops);
+
+    /* Live as soon as it is added, everything else must be ready */
+    result = aesd_setup_cdev(dev, index);
+    if (result) {
+        goto fail;
+    }
+
+    return 0;
+
+    fail:
+       /* Nothing was written yet, only the ring storage itself needs freeing */
+       aesd_teardown_device(dev);
+       return result;
+}
+
+
+int aesd_init_module(void)
+{
+    dev_t dev = 0;
+    int result;
+    unsigned int index = 0;
+
+    PDEBUG("aesdchar module init");
+    if ((aesd_nr_devs == 0) || (aesd_nr_devs > AESDCHAR_MAX_DEVICES)) {
+        printk(KERN_ERR "aesd_nr_devs %u is out of range 1..%u", aesd_nr_devs, AESDCHAR_MAX_DEVICES);
+        return -EINVAL;
+    }
+
+    if (aesd_overflow_policy > AESD_OVERFLOW_MAX) {
+        printk(KERN_ERR "aesd_overflow_policy %u is not one of 0..%u", aesd_overflow_policy, AESD_OVERFLOW_MAX);
+        return -EINVAL;
+    }
+
+    result = alloc_chrdev_region(&dev, aesd_minor, aesd_nr_devs,
+            "aesdchar");
+    aesd_major = MAJOR(dev);
+    if (result < 0) {
+        printk(KERN_WARNING "Can't get major %d\n", aesd_major);
+        return result;
+    }
+
+    /* debugfs is best effort, its helpers accept an error pointer parent */
+    aesd_debugfs_dir = debugfs_create_dir("aesdchar", NULL);
+    result = aesd_alloc_init(aesd_debugfs_dir);
+    if (result) {
+        printk(KERN_ERR "Can't create the aesdchar payload caches");
+        debugfs_remove_recursive(aesd_debugfs_dir);
+        unregister_chrdev_region(dev, aesd_nr_devs);
+        return result;
+    }
+
+    aesd_devices = kcalloc(aesd_nr_devs, sizeof(struct aesd_dev), GFP_KERNEL);
+    if (!aesd_devices) {
+        result = -ENOMEM;
+        printk(KERN_ERR "kcalloc failed for %u aesd devices", aesd_nr_devs);
+        goto fail;
+    }
+
+    for (index = 0; index < aesd_nr_devs; index++) {
+        result = aesd_setup_device(&aesd_devices[index], index);
+        if (result) {
+            goto fail;
+        }
+    }
+
     return result;
 
     fail:
-       aesd_cleanup_module();
+       /* Devices before index are fully set up and may already be open */
+       while ((aesd_devices != NULL) && (index-- > 0)) {
+           cdev_del(&aesd_devices[index].cdev);
+           aesd_teardown_device(&aesd_devices[index]);
+       }
+
+       kfree(aesd_devices);
+       aesd_devices = NULL;
+       debugfs_remove_recursive(aesd_debugfs_dir);
+       aesd_alloc_exit();
+       unregister_chrdev_region(dev, aesd_nr_devs);
        return result;
 }
 
 
 void aesd_cleanup_module(void)
 {
-    uint8_t index = 0U;
+    unsigned int index;
     dev_t devno = MKDEV(aesd_major, aesd_minor);
 
     PDEBUG("cleanup module");
-    cdev_del(&aesd_device->cdev);
-
-    /**
-     * TODO: cleanup AESD specific poritions here as necessary
-     */
-    mutex_destroy(&aesd_device->mutex_lock);
-    for (index = 0; index < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; index++)
-    {
-        if (aesd_device->circ_buffer->entry[index].buffptr != NULL)
-        {
-            kfree(aesd_device->circ_buffer->entry[index].buffptr);
-            aesd_device->circ_buffer->entry[index].buffptr = NULL;
-        }
+    for (index = 0; index < aesd_nr_devs; index++) {
+        cdev_del(&aesd_devices[index].cdev);
+        aesd_teardown_device(&aesd_devices[index]);
     }
 
-    kfree(aesd_device->circ_buffer);
-    kfree(aesd_device);
+    kfree(aesd_devices);
+    debugfs_remove_recursive(aesd_debugfs_dir);
+    aesd_alloc_exit();
 
-    unregister_chrdev_region(devno, 1);
+    unregister_chrdev_region(devno, aesd_nr_devs);
 }
 
 
@@ -0,0 +1,187 @@
+/**
+ * @file aesdsocket-timer-wheel.c
+ * @brief Hashed timing wheel for aesdsocket connection deadlines
+ *
+ * Entries are hashed to slot (current + ticks) % TIMER_WHEEL_SLOTS and
+ * carry the number of full revolutions left, so timeouts longer than one
+ * revolution need no second level.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "aesdsocket-timer-wheel.h"
+
+/**
+ * @return CLOCK_MONOTONIC time in milliseconds, the time base of every wheel
+ */
+uint64_t timer_wheel_now_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000U) + ((uint64_t)now.tv_nsec / 1000000U);
+}
+
+/**
+ * Initializes the wheel to an empty state starting at the current time
+ * @param wheel the wheel to initialize
+ */
+void timer_wheel_init(struct timer_wheel *wheel)
+{
+    memset(wheel, 0, sizeof(struct timer_wheel));
+    pthread_mutex_init(&wheel->lock, NULL);
+    wheel->last_ms = timer_wheel_now_ms();
+}
+
+/**
+ * @param wheel the wheel to destroy, entries still armed are simply forgotten
+ */
+void timer_wheel_destroy(struct timer_wheel *wheel)
+{
+    pthread_mutex_destroy(&wheel->lock);
+}
+
+/**
+ * @param entry the entry to initialize in disarmed state
+ * @param expired callback invoked when the entry expires
+ * @param context passed to expired
+ */
+void timer_entry_init(struct timer_entry *entry, timer_expired_fn expired, void *context)
+{
+    memset(entry, 0, sizeof(struct timer_entry));
+    entry->expired = expired;
+    entry->context = context;
+}
+
+static void timer_wheel_unlink(struct timer_wheel *wheel, struct timer_entry *entry)
+{
+    if (entry->prev != NULL)
+    {
+        entry->prev->next = entry->next;
+    }
+    else
+    {
+        wheel->slots[entry->slot] = entry->next;
+    }
+
+    if (entry->next != NULL)
+    {
+        entry->next->prev = entry->prev;
+    }
+
+    entry->next = NULL;
+    entry->prev = NULL;
+    entry->armed = false;
+}
+
+static void timer_wheel_link(struct timer_wheel *wheel, struct timer_entry *entry, uint64_t timeout_ms)
+{
+    /* Round up, an entry never expires early */
+    uint64_t ticks = (timeout_ms + TIMER_WHEEL_TICK_MS - 1U) / TIMER_WHEEL_TICK_MS;
+
+    if (ticks == 0)
+    {
+        ticks = 1;
+    }
+
+    entry->slot = (uint32_t)((wheel->current + ticks) % TIMER_WHEEL_SLOTS);
+    entry->rounds = (ticks - 1U) / TIMER_WHEEL_SLOTS;
+    entry->prev = NULL;
+    entry->next = wheel->slots[entry->slot];
+    if (entry->next != NULL)
+    {
+        entry->next->prev = entry;
+    }
+
+    wheel->slots[entry->slot] = entry;
+    entry->armed = true;
+}
+
+/**
+ * Arms entry to expire after timeout_ms, re-arming an armed entry moves it
+ * @param wheel the wheel to arm entry on
+ * @param entry the entry to arm
+ * @param timeout_ms milliseconds from now, rounded up to TIMER_WHEEL_TICK_MS
+ */
+void timer_wheel_arm(struct timer_wheel *wheel, struct timer_entry *entry, uint64_t timeout_ms)
+{
+    pthread_mutex_lock(&wheel->lock);
+    if (entry->armed)
+    {
+        timer_wheel_unlink(wheel, entry);
+    }
+
+    timer_wheel_link(wheel, entry, timeout_ms);
+    pthread_mutex_unlock(&wheel->lock);
+}
+
+/**
+ * Disarms entry. Once this returns the expiry callback of entry is neither
+ * running nor going to run, so whatever it refers to may be reused.
+ * @param wheel the wheel entry was armed on
+ * @param entry the entry to disarm, may already be disarmed
+ */
+void timer_wheel_cancel(struct timer_wheel *wheel, struct timer_entry *entry)
+{
+    pthread_mutex_lock(&wheel->lock);
+    if (entry->armed)
+    {
+        timer_wheel_unlink(wheel, entry);
+    }
+
+    pthread_mutex_unlock(&wheel->lock);
+}
+
+/**
+ * Processes every tick up to now_ms and runs the callbacks of expired entries
+ * @param wheel the wheel to advance
+ * @param now_ms current time as returned by timer_wheel_now_ms()
+ */
+void timer_wheel_advance(struct timer_wheel *wheel, uint64_t now_ms)
+{
+    struct timer_entry *pending;
+    struct timer_entry *entry;
+    uint64_t next_ms;
+
+    pthread_mutex_lock(&wheel->lock);
+    while ((wheel->last_ms + TIMER_WHEEL_TICK_MS) <= now_ms)
+    {
+        wheel->last_ms += TIMER_WHEEL_TICK_MS;
+        wheel->current = (wheel->current + 1U) % TIMER_WHEEL_SLOTS;
+
+        /* Detach the slot, entries re-armed by their callback land on a fresh list */
+        pending = wheel->slots[wheel->current];
+        wheel->slots[wheel->current] = NULL;
+
+        while (pending != NULL)
+        {
+            entry = pending;
+            pending = entry->next;
+            entry->prev = NULL;
+            entry->next = NULL;
+
+            if (entry->rounds > 0)
+            {
+                entry->rounds--;
+                entry->next = wheel->slots[wheel->current];
+                if (entry->next != NULL)
+                {
+                    entry->next->prev = entry;
+                }
+
+                wheel->slots[wheel->current] = entry;
+                continue;
+            }
+
+            entry->armed = false;
+            next_ms = entry->expired(entry->context, now_ms);
+            if (next_ms != 0)
+            {
+                timer_wheel_link(wheel, entry, next_ms);
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&wheel->lock);
+}
@@ -0,0 +1,78 @@
+/*
+ * aesdsocket-timer-wheel.h
+ *
+ * Hashed timing wheel used by aesdsocket to enforce connection deadlines.
+ * Arming and cancelling a timer is O(1), a tick only visits the entries
+ * hashed to one slot.
+ */
+
+#ifndef AESDSOCKET_TIMER_WHEEL_H
+#define AESDSOCKET_TIMER_WHEEL_H
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uintx_t
+#include <stdbool.h>
+#include <pthread.h>
+
+#define TIMER_WHEEL_SLOTS   512
+#define TIMER_WHEEL_TICK_MS 100
+
+/**
+ * Called by timer_wheel_advance() with the wheel lock held once the entry
+ * expires. Returns 0 to leave the entry disarmed, or the number of
+ * milliseconds after which it should expire again.
+ */
+typedef uint64_t (*timer_expired_fn)(void *context, uint64_t now_ms);
+
+struct timer_entry
+{
+    /**
+     * Neighbours in the slot list, only valid while armed
+     */
+    struct timer_entry *next;
+    struct timer_entry *prev;
+    /**
+     * Full revolutions of the wheel left before the entry expires
+     */
+    uint64_t rounds;
+    /**
+     * Slot the entry is linked into
+     */
+    uint32_t slot;
+    bool armed;
+    timer_expired_fn expired;
+    void *context;
+};
+
+struct timer_wheel
+{
+    /**
+     * Serializes arming, cancelling and expiry callbacks
+     */
+    pthread_mutex_t lock;
+    struct timer_entry *slots[TIMER_WHEEL_SLOTS];
+    /**
+     * Slot of the last processed tick
+     */
+    uint32_t current;
+    /**
+     * Monotonic time of the last processed tick
+     */
+    uint64_t last_ms;
+};
+
+extern uint64_t timer_wheel_now_ms(void);
+
+extern void timer_wheel_init(struct timer_wheel *wheel);
+
+extern void timer_wheel_destroy(struct timer_wheel *wheel);
+
+extern void timer_entry_init(struct timer_entry *entry, timer_expired_fn expired, void *context);
+
+extern void timer_wheel_arm(struct timer_wheel *wheel, struct timer_entry *entry, uint64_t timeout_ms);
+
+extern void timer_wheel_cancel(struct timer_wheel *wheel, struct timer_entry *entry);
+
+extern void timer_wheel_advance(struct timer_wheel *wheel, uint64_t now_ms);
+
+#endif /* AESDSOCKET_TIMER_WHEEL_H */
@@ -1,4 +1,4 @@
-// #define _GNU_SOURCE
+#define _GNU_SOURCE /* CPU affinity, sched_getcpu() */
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <syslog.h>
@@ -9,17 +9,47 @@
 #include <string.h>
 #include <stdlib.h>
 #include <netdb.h> /* gethints() */
+#include <sys/un.h> /* sockaddr_un */
+#include <poll.h>
 #include <arpa/inet.h> /* get IP */
 #include <sys/ioctl.h> /* ioctl */
+#include <sys/sendfile.h>
+#include <sys/stat.h> /* fstat */
+#include <sys/uio.h> /* writev */
+#include <fcntl.h> /* open */
 #include <pthread.h>
+#include <sched.h> /* cpu_set_t */
 #include <time.h>
 
 #include "aesd_ioctl.h" /* seekto struct */
+#include "aesdsocket-timer-wheel.h"
 
 #ifndef USE_AESD_CHAR_DEVICE
 #define USE_AESD_CHAR_DEVICE (0)
 #endif /* USE_AESD_CHAR_DEVICE */
 
+/* USDT probes for perf/bpftrace, a single nop each when no tracer is attached */
+#ifndef USE_USDT_PROBES
+#if defined(__has_include) && __has_include(<sys/sdt.h>)
+#define USE_USDT_PROBES (1)
+#else
+#define USE_USDT_PROBES (0)
+#endif
+#endif /* USE_USDT_PROBES */
+
+#if USE_USDT_PROBES == 1
+#include <sys/sdt.h>
+#define TRACE_PROBE(name)               DTRACE_PROBE(aesdsocket, name)
+#define TRACE_PROBE1(name, a)           DTRACE_PROBE1(aesdsocket, name, a)
+#define TRACE_PROBE2(name, a, b)        DTRACE_PROBE2(aesdsocket, name, a, b)
+#define TRACE_PROBE3(name, a, b, c)     DTRACE_PROBE3(aesdsocket, name, a, b, c)
+#else /* USE_USDT_PROBES == 0 */
+#define TRACE_PROBE(name)
+#define TRACE_PROBE1(name, a)
+#define TRACE_PROBE2(name, a, b)
+#define TRACE_PROBE3(name, a, b, c)
+#endif /* USE_USDT_PROBES == 1 */
+
 /* ------------------------------------------------------------------------------- */
 /* typedef */
 
@@ -44,15 +74,36 @@ typedef unsigned long long U64;
 #define SOCKET_DATA_FILEPATH        ("/dev/aesdchar")
 #endif /* USE_AESD_CHAR_DEVICE == 0 */
 
-#define _XOPEN_SOURCE               (700)
 #define SOCKET_DOMAIN               (PF_INET)
 #define SOCKET_TYPE                 (SOCK_STREAM)
-#define DAEMON_ARG                  ("-d")
 #define SOCKET_PORT                 ("9000")
 #define SOCKET_INC_CONNECT_MAX      (50U)
+#define CONNECTION_MEMORY_BUDGET    (16U * 1024U * 1024U)
+#define ACCEPT_BACKOFF_MS           (10U)
 #define DATA_BLOCK_SIZE             (512U)
+#define ECHO_SEND_BLOCK_SIZE        (64U * 1024U)
 #define NUM_THREADS                 (128)
 #define TIMESTAMP_PRINT_DELAY_MS    (10U * 1000U)
+#define UDP_BATCH_SIZE              (64U)
+#define UDP_DATAGRAM_MAX            (4U * DATA_BLOCK_SIZE)
+#define UDP_RCVBUF_SIZE             (4 * 1024 * 1024)
+#define OPTSTRING                   ("da:w:t:u:Ub:c:m:M:I:R:W:")
+#define SENDFD_CMD                  ("AESDSOCKET_SENDFD")
+#define SUBSCRIBE_CMD               ("AESDSOCKET_SUBSCRIBE\n")
+#define CHANNEL_CMD                 ("AESDSOCKET_CHANNEL:")
+#define FRAMING_CMD                 ("AESDSOCKET_FRAMING:LEN\n")
+#define FRAMED_SUBSCRIBE_CMD        ("AESDSOCKET_SUBSCRIBE:LEN\n")
+#define FRAME_LOG_FILEPATH          ("/var/tmp/aesdsocketframes")
+#define FRAME_HEADER_SIZE           (4U)
+#define SOCKET_CHANNELS_MAX         (16U)
+#define CHANNEL_PATH_MAX            (64U)
+#define SUBSCRIBER_QUEUE_DEPTH      (1024U)
+#define SUBSCRIBER_QUEUE_BYTES      (256U * 1024U)
+#define SUBSCRIBER_POLL_MS          (1000U)
+#define IDLE_TIMEOUT_MS             (10U * 1000U)
+#define READ_TIMEOUT_MS             (30U * 1000U)
+#define WRITE_TIMEOUT_MS            (30U * 1000U)
+#define TIMEOUT_RECHECK_MS          (1000U)
 
 /* ------------------------------------------------------------------------------- */
 /* PRIVATE TYPES */
@@ -69,24 +120,187 @@ typedef enum
     PASS = 0
 } Result;
 
+/**
+ * What a connection is doing, selects the deadline its timer enforces
+ */
+typedef enum
+{
+    CONN_RECEIVING, /* idle and read deadlines */
+    CONN_SENDING,   /* write deadline */
+    CONN_WAITING    /* subscriber with nothing to send, no deadline */
+} conn_phase;
+
+/**
+ * Committed packet shared by every subscriber queue it was pushed to,
+ * freed by whoever drops the last reference
+ */
+typedef struct
+{
+    U32 refcount;
+    size_t len;
+    U8 data[];
+} published_record;
+
+/**
+ * Bounded queue of records waiting to be pushed to one subscriber.
+ * Records that do not fit are dropped and counted (backpressure stays
+ * with the subscriber, publishers never block on it).
+ */
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    published_record* records[SUBSCRIBER_QUEUE_DEPTH];
+    U32 head;
+    U32 count;
+    size_t queued_bytes;
+    U64 delivered;
+    U64 dropped;
+    Boolean framed; /* also gets framed records, each one behind a length header */
+} subscriber;
+
+/**
+ * Independent log with its own lock, subscribers and echo scope.
+ * Channel 0 is SOCKET_DATA_FILEPATH, channel N appends N to that path
+ * (/var/tmp/aesdsocketdataN or /dev/aesdcharN).
+ *
+ * FRAMING_CMD records go to a separate frame log (FRAME_LOG_FILEPATH,
+ * numbered the same way) stored in wire format, header and payload, so
+ * they keep their boundaries and never break the newline framing of the
+ * channel log. It is a regular file with the char device too, aesdchar
+ * entries are newline terminated.
+ */
+typedef struct
+{
+    pthread_mutex_t file_mutex; /* serializes appends to both logs */
+    char path[CHANNEL_PATH_MAX];
+    char frame_path[CHANNEL_PATH_MAX];
+    Boolean frames_used; /* frame log written to at least once, removed at teardown */
+    pthread_mutex_t subscribers_mutex;
+    subscriber* subscribers[NUM_THREADS];
+    U32 num_subscribers;
+    Boolean used; /* written to at least once, removed at teardown */
+} channel;
+
 typedef struct
 {
     int conf_fd;
-    struct sockaddr_in *client_addr;
+    channel* chan; /* selected with CHANNEL_CMD, channel 0 by default */
+    struct sockaddr_storage client_addr;
     char* client_ip;
+    U8* buffer; /* per-thread packet buffer, first touched on the thread's own CPU */
+    size_t buffer_size; /* bytes allocated (and charged to the memory budget) for buffer */
+    Boolean active; /* slot is serving a connection, cleared by the worker on exit */
+    Boolean joinable; /* slot's thread was started and has not been joined yet */
+    Boolean shed; /* packet dropped by admission control, no echo is sent */
+    Boolean subscribe; /* client asked for SUBSCRIBE_CMD (or FRAMED_SUBSCRIBE_CMD) instead of an echo */
+    Boolean framed; /* client asked for FRAMING_CMD (or FRAMED_SUBSCRIBE_CMD), records carry a length header */
+    subscriber sub;
+    struct timer_entry timer; /* enforces the deadline of the current phase */
+    conn_phase phase;
+    U64 phase_start_ms;
+    U64 last_activity_ms; /* last byte received or block sent */
+    Boolean timed_out; /* shut down by the timer, the partial packet is dropped */
 } task_params;
 
+/**
+ * Set of CPUs a group of threads is pinned to.
+ * Placement is left to the scheduler when not enabled.
+ */
+typedef struct
+{
+    Boolean enabled;
+    cpu_set_t cpus;
+} cpu_placement;
+
+/**
+ * Per-CPU counters, updated with relaxed atomics by whichever
+ * thread is currently running on that CPU
+ */
+typedef struct
+{
+    U64 connections;
+    U64 bytes_received;
+    U64 bytes_sent;
+} cpu_stats;
+
+/**
+ * Publish/subscribe counters
+ */
+typedef struct
+{
+    U64 subscriptions;
+    U64 delivered;
+    U64 dropped;
+} subscription_stats;
+
+/**
+ * Admission control and overload shedding counters
+ */
+typedef struct
+{
+    U64 accepted;
+    U64 rejected_connections; /* connection limit reached or no free slot */
+    U64 rejected_memory;      /* global memory budget exhausted at accept or subscribe, atomic */
+    U64 shed_packets;         /* packets dropped for exceeding a memory budget */
+    U64 accept_errors;        /* EMFILE, ENFILE, ENOBUFS, ENOMEM... */
+} admission_stats;
+
+/**
+ * Connections shut down for missing a deadline
+ */
+typedef struct
+{
+    U64 idle;  /* no byte received for idle_timeout_ms */
+    U64 read;  /* packet not complete within read_timeout_ms */
+    U64 write; /* no send progress for write_timeout_ms */
+} timeout_stats;
+
 
 /* GLOBAL VARIABLES */
 
 struct addrinfo *servinfo;
 int listen_fd;
+int unix_listen_fd = FAIL;
+const char* unix_socket_path = NULL;
+int udp_fd = FAIL;
+Boolean udp_enabled = FALSE;
+pthread_t udp_thread;
 Boolean is_daemon = FALSE;
 pthread_t threads[NUM_THREADS];
 task_params t_params[NUM_THREADS];
-pthread_mutex_t file_mutex;
+channel channels[SOCKET_CHANNELS_MAX];
 Boolean timestamp_thread_exit;
 
+cpu_placement accept_placement;
+cpu_placement worker_placement;
+cpu_placement timestamp_placement;
+cpu_stats *per_cpu_stats = NULL;
+int num_cpus = 0;
+volatile sig_atomic_t stats_dump_requested = 0;
+volatile sig_atomic_t exit_requested = 0;
+sigset_t listener_sigmask; /* accept loop mask with SIGINT/SIGTERM/SIGUSR1 unblocked, used by ppoll() */
+
+int listen_backlog = SOCKET_INC_CONNECT_MAX;
+U32 max_connections = NUM_THREADS - 1; /* slot 0 belongs to the timestamp thread */
+U64 connection_memory_budget = CONNECTION_MEMORY_BUDGET;
+U64 global_memory_budget = 0; /* 0 - unlimited */
+U64 memory_in_use = 0;
+U32 active_connections = 0;
+int spare_fd = FAIL; /* released to accept-and-close a connection on EMFILE */
+admission_stats admission;
+
+U32 num_subscribers = 0; /* across all channels */
+subscription_stats subscription;
+
+U64 idle_timeout_ms = IDLE_TIMEOUT_MS; /* 0 - disabled */
+U64 read_timeout_ms = READ_TIMEOUT_MS; /* 0 - disabled */
+U64 write_timeout_ms = WRITE_TIMEOUT_MS; /* 0 - disabled */
+struct timer_wheel connection_timers;
+pthread_t timer_thread;
+Boolean timers_enabled = FALSE;
+timeout_stats timeouts;
+
 /**
  * Flag that indicates whether any client started sending to socket
  * Controls when timestamping thread starts outputting to file
@@ -101,10 +315,54 @@ void parse_args(int, char**);
 void teardown(void);
 Boolean allocateMemory(U8 **buffer, U16 datablock_size);
 void printClientIpAddress(Boolean open_connection, task_params* t_arg);
-
-int acceptConnection(struct sockaddr_in* client_addr, int listen_fd);
-Boolean readClientDataToFile(int configured_fd, long *offset);
-Boolean sendDataBackToClient(int configured_fd, long *offset);
+Boolean parseCpuList(const char* list, cpu_placement* placement);
+Boolean createThread(pthread_t* thread, void* (*task)(void*), void* arg, cpu_placement* placement);
+void accountCpuStats(U64 connections, U64 bytes_received, U64 bytes_sent);
+void printStats(void);
+Boolean parseNumber(const char* arg, U64 min, U64 max, U64* value);
+Boolean chargeMemory(U64 bytes);
+void releaseMemory(U64 bytes);
+Boolean growConnectionBuffer(task_params* conn, size_t min_size);
+int admitConnection(int conf_fd);
+void shedPendingConnection(int listen_fd);
+void setConnectionPhase(task_params* conn, conn_phase phase);
+void touchConnection(task_params* conn);
+U64 connectionDeadline(task_params* conn, U64** counter);
+uint64_t connectionTimerExpired(void* context, uint64_t now_ms);
+void timer_task(void*);
+
+void setupUnixListener(void);
+void setupUdpListener(void);
+void setupChannels(void);
+Boolean selectChannel(task_params* conn, const char* cmd);
+FILE* openChannel(channel* chan);
+void lockDataFile(channel* chan);
+void unlockDataFile(channel* chan);
+Boolean appendPacket(FILE* fstream, const U8* data, size_t len);
+void commitDatagrams(struct mmsghdr* msgs, unsigned int count);
+void udp_task(void*);
+int waitForListener(void);
+int acceptConnection(struct sockaddr_storage* client_addr, int listen_fd);
+ssize_t receiveFromClient(int configured_fd, U8* buf, size_t len, int* passed_fd);
+Boolean receiveExactly(task_params* conn, U8* buf, size_t len, int* passed_fd);
+Boolean receiveFramedRecord(task_params* conn, size_t* packet_len, int* passed_fd);
+Boolean commitFramedRecord(task_params* conn, size_t record_len);
+Boolean drainPassedFd(task_params* conn, int passed_fd, size_t* payload_len);
+Boolean readClientDataToFile(task_params* conn, long *offset);
+Boolean sendAll(int configured_fd, const U8* buf, size_t len, int flags);
+void encodeFrameHeader(U8* header, U32 len);
+Boolean sendFrameHeader(int configured_fd, U32 len);
+Boolean streamCommittedData(task_params* conn, int data_fd, off_t position, off_t committed_len);
+Boolean sendFramesBackToClient(task_params* conn);
+Boolean copyCommittedData(task_params* conn, int data_fd, off_t position, off_t committed_len, size_t* copied_len);
+Boolean sendCopiedData(task_params* conn, size_t len);
+Boolean sendDataBackToClient(task_params* conn, long *offset);
+void publishRecord(channel* chan, const U8* data, size_t len, Boolean add_newline, Boolean framed_record);
+void releaseRecord(published_record* record);
+Boolean addSubscriber(channel* chan, subscriber* sub, Boolean framed);
+void removeSubscriber(channel* chan, subscriber* sub);
+Boolean subscriberPeerClosed(int configured_fd);
+Boolean streamToSubscriber(task_params* conn);
 Boolean aesdsocket_task(void*);
 void timestamp_task(void*);
 U16 getTimespecDiffMs(struct timespec t1, struct timespec t2);
@@ -115,36 +373,189 @@ void signalHandler(int signal_number)
 #ifdef DEBUG_ON
     printf("caught signal %d\n", signal_number);
 #endif /* DEBUG_ON */
-    syslog(LOG_INFO, "Caught signal, exiting");
-    teardown();
+    /* Both are handled by the accept loop, syslog() is not async-signal-safe */
+    if (signal_number == SIGUSR1)
+    {
+        stats_dump_requested = 1;
+        return;
+    }
+
+    exit_requested = 1;
 }
 
 void parse_args(int argc, char** argv)
+/**
+ * @brief Parses command line options
+ *
+ *  -d            run as daemon
+ *  -a <cpulist>  pin the accept thread, e.g. "0" or "0-3,8"
+ *  -w <cpulist>  pin connection worker threads
+ *  -t <cpulist>  pin the timestamp thread
+ *  -u <path>     also listen on a UNIX stream socket at path
+ *  -U            also accept fire-and-forget packets over UDP on SOCKET_PORT
+ *  -b <backlog>  listen() backlog
+ *  -c <count>    maximum number of concurrent connections
+ *  -m <bytes>    memory budget of a single connection (largest packet buffered)
+ *  -M <bytes>    memory budget of all connections together, 0 - unlimited
+ *  -I <ms>       idle timeout, no byte received while waiting for a packet, 0 - disabled
+ *  -R <ms>       read timeout, a whole packet must arrive within it, 0 - disabled
+ *  -W <ms>       write timeout, no send progress to a client, 0 - disabled
+ */
 {
-    if (argc == 2)
+    int opt;
+    Boolean result = TRUE;
+    U64 value;
+
+    while ((opt = getopt(argc, argv, OPTSTRING)) != FAIL)
     {
-        if (strcmp(argv[1], DAEMON_ARG) == 0)
+        switch (opt)
         {
-#ifdef DEBUG_ON           
-            printf("Running in daemon mode\n");
+            case 'd':
+#ifdef DEBUG_ON
+                printf("Running in daemon mode\n");
 #endif /* DEBUG_ON */
-            is_daemon = TRUE;
-        }
-        else
-        {
-            printf("Invalid argument!\n");
-            exit(0);
+                is_daemon = TRUE;
+                break;
+
+            case 'a':
+                result &= parseCpuList(optarg, &accept_placement);
+                break;
+
+            case 'w':
+                result &= parseCpuList(optarg, &worker_placement);
+                break;
+
+            case 't':
+                result &= parseCpuList(optarg, &timestamp_placement);
+                break;
+
+            case 'u':
+                unix_socket_path = optarg;
+                break;
+
+            case 'U':
+                udp_enabled = TRUE;
+                break;
+
+            case 'b':
+                result &= parseNumber(optarg, 1, SOMAXCONN, &value);
+                listen_backlog = (int)value;
+                break;
+
+            case 'c':
+                result &= parseNumber(optarg, 1, NUM_THREADS - 1, &value);
+                max_connections = (U32)value;
+                break;
+
+            case 'm':
+                result &= parseNumber(optarg, DATA_BLOCK_SIZE, (U64)SIZE_MAX, &connection_memory_budget);
+                break;
+
+            case 'M':
+                result &= parseNumber(optarg, 0, (U64)SIZE_MAX, &global_memory_budget);
+                break;
+
+            case 'I':
+                result &= parseNumber(optarg, 0, UINT32_MAX, &idle_timeout_ms);
+                break;
+
+            case 'R':
+                result &= parseNumber(optarg, 0, UINT32_MAX, &read_timeout_ms);
+                break;
+
+            case 'W':
+                result &= parseNumber(optarg, 0, UINT32_MAX, &write_timeout_ms);
+                break;
+
+            default:
+                result = FALSE;
+                break;
         }
     }
-    else if (argc > 2)
+
+    if ((result == FALSE) || (optind < argc))
     {
-        printf("Too many arguments!\n");
+        printf("Invalid argument!\n");
+        printf("Usage: %s [-d] [-a cpulist] [-w cpulist] [-t cpulist] [-u path] [-U]\n"
+               "       [-b backlog] [-c connections] [-m conn_bytes] [-M total_bytes]\n"
+               "       [-I idle_ms] [-R read_ms] [-W write_ms]\n", argv[0]);
         exit(-1);
     }
-    else
+}
+
+Boolean parseNumber(const char* arg, U64 min, U64 max, U64* value)
+{
+    char* end;
+
+    errno = 0;
+    *value = strtoull(arg, &end, 10);
+    if ((errno != 0) || (end == arg) || (*end != '\0') || (*value < min) || (*value > max))
     {
-        // all good
+        printf("parseNumber(): %s is out of range [%llu, %llu]\n", arg, min, max);
+        return FALSE;
     }
+
+    return TRUE;
+}
+
+Boolean parseCpuList(const char* list, cpu_placement* placement)
+/**
+ * @brief Parses a CPU list in the taskset/cpuset format ("0-3,8")
+ *
+ * @returns FALSE if the list is malformed or names a CPU that does not exist
+ */
+{
+    long first, last, cpu;
+    char* end;
+    long max_cpu = sysconf(_SC_NPROCESSORS_CONF);
+
+    CPU_ZERO(&placement->cpus);
+    placement->enabled = FALSE;
+
+    while (*list != '\0')
+    {
+        first = strtol(list, &end, 10);
+        if ((end == list) || (first < 0))
+        {
+            return FALSE;
+        }
+
+        last = first;
+        if (*end == '-')
+        {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if ((end == list) || (last < first))
+            {
+                return FALSE;
+            }
+        }
+
+        if ((last >= max_cpu) || (last >= CPU_SETSIZE))
+        {
+            printf("parseCpuList(): CPU %ld is not available\n", last);
+            return FALSE;
+        }
+
+        for (cpu = first; cpu <= last; cpu++)
+        {
+            CPU_SET(cpu, &placement->cpus);
+        }
+
+        if (*end == ',')
+        {
+            end++;
+        }
+        else if (*end != '\0')
+        {
+            return FALSE;
+        }
+
+        list = end;
+    }
+
+    placement->enabled = (CPU_COUNT(&placement->cpus) > 0) ? TRUE : FALSE;
+    return placement->enabled;
 }
 
 void setup(void)
@@ -155,13 +566,14 @@ void setup(void)
  */
 {
     struct sigaction signal_action;
+    sigset_t block_set;
     struct addrinfo hints;
     pid_t pid;
 
     client_started_sending = FALSE;
 
-    /* Init mutex */
-    pthread_mutex_init(&file_mutex, NULL);
+    /* Init channels and their mutexes */
+    setupChannels();
 
     /* Init syslog */
     openlog(NULL, LOG_NDELAY, LOG_USER);
@@ -171,6 +583,39 @@ void setup(void)
     signal_action.sa_handler = signalHandler;
     sigaction(SIGTERM, &signal_action, NULL);
     sigaction(SIGINT, &signal_action, NULL);
+    sigaction(SIGUSR1, &signal_action, NULL);
+
+    /* Only delivered inside ppoll() in waitForListener(), a signal that arrives
+     * after the accept loop checked its flags stays pending instead of being lost */
+    sigemptyset(&block_set);
+    sigaddset(&block_set, SIGUSR1);
+    sigaddset(&block_set, SIGINT);
+    sigaddset(&block_set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block_set, &listener_sigmask);
+
+    /* sendfile() has no MSG_NOSIGNAL, a vanished client must not kill the server */
+    signal_action.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &signal_action, NULL);
+
+    /* Per-CPU statistics, one slot per configured CPU */
+    num_cpus = (int)sysconf(_SC_NPROCESSORS_CONF);
+    per_cpu_stats = (cpu_stats*)calloc(num_cpus, sizeof(cpu_stats));
+    if (per_cpu_stats == NULL)
+    {
+        printf("calloc: %s\n", strerror(errno));
+        exit(-1);
+    }
+
+    /* Connection deadlines */
+    timers_enabled = ((idle_timeout_ms != 0) || (read_timeout_ms != 0) || (write_timeout_ms != 0)) ? TRUE : FALSE;
+    timer_wheel_init(&connection_timers);
+    for (int i = 1; i < NUM_THREADS; i++)
+    {
+        timer_entry_init(&t_params[i].timer, connectionTimerExpired, &t_params[i]);
+    }
+
+    /* Keep a descriptor in reserve for shedding connections once we run out of them */
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
 
     /* Open socket */
     if ((listen_fd = socket(SOCKET_DOMAIN, SOCKET_TYPE, 0)) == FAIL)
@@ -230,31 +675,175 @@ void setup(void)
     }
 
     /* Listen for incoming connections */
-    if (listen(listen_fd, SOCKET_INC_CONNECT_MAX) == FAIL)
+    if (listen(listen_fd, listen_backlog) == FAIL)
     {
         printf("listen: %s\n", strerror(errno));
         exit(-1);
     }
+
+    if (unix_socket_path != NULL)
+    {
+        setupUnixListener();
+    }
+
+    if (udp_enabled == TRUE)
+    {
+        setupUdpListener();
+    }
+
+    /* Pin the accept loop (this thread), done after fork() so it applies to the daemon */
+    if (accept_placement.enabled == TRUE)
+    {
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &accept_placement.cpus) != PASS)
+        {
+            printf("pthread_setaffinity_np: %s\n", strerror(errno));
+        }
+    }
+}
+
+void setupUnixListener(void)
+/**
+ * @brief Opens the optional UNIX stream listener for co-located producers
+ *
+ * Connections on it speak the same protocol as TCP ones and may in addition
+ * pass a file descriptor with SENDFD_CMD (see drainPassedFd())
+ */
+{
+    struct sockaddr_un unix_addr;
+
+    if (strlen(unix_socket_path) >= sizeof(unix_addr.sun_path))
+    {
+        printf("UNIX socket path is too long: %s\n", unix_socket_path);
+        exit(-1);
+    }
+
+    if ((unix_listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == FAIL)
+    {
+        printf("Open UNIX socket error: %s\n", strerror(errno));
+        exit(-1);
+    }
+
+    /* Remove a stale socket left behind by a previous run */
+    unlink(unix_socket_path);
+
+    memset(&unix_addr, 0, sizeof(unix_addr));
+    unix_addr.sun_family = AF_UNIX;
+    strcpy(unix_addr.sun_path, unix_socket_path);
+    if (bind(unix_listen_fd, (struct sockaddr*)&unix_addr, sizeof(unix_addr)) == FAIL)
+    {
+        printf("bind UNIX: %s\n", strerror(errno));
+        exit(-1);
+    }
+
+    if (listen(unix_listen_fd, listen_backlog) == FAIL)
+    {
+        printf("listen UNIX: %s\n", strerror(errno));
+        exit(-1);
+    }
+}
+
+void setupUdpListener(void)
+/**
+ * @brief Binds the optional UDP socket on SOCKET_PORT, drained by udp_task()
+ */
+{
+    struct addrinfo hints;
+    struct addrinfo *udp_info;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = SOCKET_DOMAIN;
+    hints.ai_flags = AI_PASSIVE;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(NULL, SOCKET_PORT, &hints, &udp_info) != PASS)
+    {
+        printf("getaddrinfo UDP: %s\n", strerror(errno));
+        exit(-1);
+    }
+
+    if ((udp_fd = socket(udp_info->ai_family, SOCK_DGRAM, 0)) == FAIL)
+    {
+        printf("Open UDP socket error: %s\n", strerror(errno));
+        exit(-1);
+    }
+
+    /* Absorb bursts while a batch is being committed, best effort */
+    if (setsockopt(udp_fd, SOL_SOCKET, SO_RCVBUF, &(int){UDP_RCVBUF_SIZE}, sizeof(int)) == FAIL)
+    {
+        printf("setsockopt RCVBUF: %s\n", strerror(errno));
+    }
+
+    if (bind(udp_fd, udp_info->ai_addr, udp_info->ai_addrlen) == FAIL)
+    {
+        printf("bind UDP: %s\n", strerror(errno));
+        exit(-1);
+    }
+
+    freeaddrinfo(udp_info);
 }
 
 void teardown(void)
 {
     timestamp_thread_exit = TRUE;
-    for(int i = 0; i < NUM_THREADS; i++)
+    if (udp_fd != FAIL)
+    {
+        /* Wakes udp_task() out of recvmmsg() */
+        shutdown(udp_fd, SHUT_RDWR);
+        pthread_join(udp_thread, NULL);
+        close(udp_fd);
+    }
+
+#if USE_AESD_CHAR_DEVICE == 0
+    pthread_join(threads[0], NULL);
+#endif /* USE_AESD_CHAR_DEVICE == 0 */
+    for(int i = 1; i < NUM_THREADS; i++)
+    {
+        if (t_params[i].joinable == TRUE)
+        {
+            /* Wake the worker up, it closes and logs the connection itself */
+            if (__atomic_load_n(&t_params[i].active, __ATOMIC_ACQUIRE) == TRUE)
+            {
+                shutdown(t_params[i].conf_fd, SHUT_RDWR);
+            }
+
+            pthread_join(threads[i], NULL);
+            t_params[i].joinable = FALSE;
+        }
+    }
+
+    if (timers_enabled == TRUE)
     {
-        close(t_params[i].conf_fd);
-        printClientIpAddress(FALSE, &t_params[i]);
-        pthread_join(threads[i], NULL);
+        pthread_join(timer_thread, NULL);
     }
 #if USE_AESD_CHAR_DEVICE == 0
-    if (remove(SOCKET_DATA_FILEPATH) == FAIL)
+    for (U32 i = 0; i < SOCKET_CHANNELS_MAX; i++)
     {
-        printf("remove: %s\n", strerror(errno));
+        if ((channels[i].used == TRUE) && (remove(channels[i].path) == FAIL))
+        {
+            printf("remove: %s\n", strerror(errno));
+        }
     }
 #endif /* USE_AESD_CHAR_DEVICE == 0 */
+    for (U32 i = 0; i < SOCKET_CHANNELS_MAX; i++)
+    {
+        if ((channels[i].frames_used == TRUE) && (remove(channels[i].frame_path) == FAIL))
+        {
+            printf("remove: %s\n", strerror(errno));
+        }
+    }
+
+    if (unix_listen_fd != FAIL)
+    {
+        close(unix_listen_fd);
+        unlink(unix_socket_path);
+    }
 
+    timer_wheel_destroy(&connection_timers);
     freeaddrinfo(servinfo);
-    pthread_mutex_destroy(&file_mutex);
+    for (U32 i = 0; i < SOCKET_CHANNELS_MAX; i++)
+    {
+        pthread_mutex_destroy(&channels[i].file_mutex);
+        pthread_mutex_destroy(&channels[i].subscribers_mutex);
+    }
 }
 
 Boolean allocateMemory(U8 **buffer, U16 datablock_size)
@@ -270,192 +859,1591 @@ Boolean allocateMemory(U8 **buffer, U16 datablock_size)
     return result;
 }
 
-void printClientIpAddress(Boolean open_connection, task_params* t_arg)
+Boolean createThread(pthread_t* thread, void* (*task)(void*), void* arg, cpu_placement* placement)
+/**
+ * @brief Starts a thread on the CPUs given by placement (if enabled)
+ *
+ * SIGUSR1, SIGINT and SIGTERM are blocked in the new thread so that they
+ * are always handled by the accept loop and never by a worker blocked in
+ * recv()/send() (teardown() joins the workers)
+ */
 {
-    struct sockaddr_in *sock_addr = t_arg->client_addr;
-    if (open_connection == TRUE)
+    Boolean result = TRUE;
+    pthread_attr_t attr;
+    sigset_t block_set, old_set;
+
+    pthread_attr_init(&attr);
+    if (placement->enabled == TRUE)
     {
-        t_arg->client_ip = inet_ntoa(sock_addr->sin_addr);
-#ifdef DEBUG_ON
-        printf("Accepted connection from %s\n", t_arg->client_ip);
-#endif /* DEBUG_ON */
-        syslog(LOG_INFO, "Accepted connection from %s", t_arg->client_ip);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &placement->cpus);
     }
-    else
+
+    sigemptyset(&block_set);
+    sigaddset(&block_set, SIGUSR1);
+    sigaddset(&block_set, SIGINT);
+    sigaddset(&block_set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block_set, &old_set);
+
+    if (pthread_create(thread, &attr, task, arg) != PASS)
     {
-        if ((t_arg->client_ip) != NULL)
-        {
-#ifdef DEBUG_ON
-            printf("Closed connection from %s\n", t_arg->client_ip);
-#endif /* DEBUG_ON */
-            syslog(LOG_INFO, "Closed connection from %s", t_arg->client_ip);
-        }
+        printf("pthread_create: %s\n", strerror(errno));
+        result = FALSE;
     }
+
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+    pthread_attr_destroy(&attr);
+    return result;
 }
 
-int acceptConnection(struct sockaddr_in* client_addr, int listen_fd)
+void accountCpuStats(U64 connections, U64 bytes_received, U64 bytes_sent)
 {
-    int configured_fd;
-    socklen_t client_addr_size;
+    int cpu = sched_getcpu();
+    cpu_stats* stats;
 
-    client_addr_size = sizeof(*client_addr);
-    memset(client_addr, 0, client_addr_size);
-    if ((configured_fd = accept(listen_fd, (struct sockaddr*)client_addr, &client_addr_size)) == FAIL)
+    if ((cpu < 0) || (cpu >= num_cpus))
     {
-        printf("accept: %s\n", strerror(errno));
-        exit(-1);
+        return;
     }
 
-    return configured_fd;
+    stats = &per_cpu_stats[cpu];
+    __atomic_fetch_add(&stats->connections, connections, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->bytes_received, bytes_received, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->bytes_sent, bytes_sent, __ATOMIC_RELAXED);
 }
 
-Boolean readClientDataToFile(int configured_fd, long *offset)
+void printStats(void)
+/**
+ * @brief Logs per-CPU counters, CPUs that did no work are skipped
+ */
 {
-    Boolean result = TRUE;
-    FILE* fstream;
-    U8* buf = NULL;
-    Boolean data_block_end = FALSE;
-    int internal_cntr = 0;
+    cpu_stats* stats;
 
-    while(data_block_end == FALSE)
+    if (per_cpu_stats == NULL)
     {
-        allocateMemory(&buf, DATA_BLOCK_SIZE);
+        return;
+    }
 
-        /* Read buffer from socket */
-        for (internal_cntr = 0; internal_cntr < DATA_BLOCK_SIZE; internal_cntr++)
+    for (int cpu = 0; cpu < num_cpus; cpu++)
+    {
+        stats = &per_cpu_stats[cpu];
+        if ((stats->connections == 0) && (stats->bytes_received == 0) && (stats->bytes_sent == 0))
         {
-            if (recv(configured_fd, &buf[internal_cntr], sizeof(char), 0) == FAIL)
-            {
-                printf("recv_read: %s\n", strerror(errno));
-                printf("configured_fd: %d\n", configured_fd);
-                data_block_end = TRUE;
-                result = FALSE;
-            }
+            continue;
+        }
 
-            if (client_started_sending == FALSE)
-            {
 #ifdef DEBUG_ON
-                printf("readClientDataToFile(): Started timestamping now\n");
+        printf("cpu%d: connections %llu, received %llu, sent %llu\n", cpu,
+            stats->connections, stats->bytes_received, stats->bytes_sent);
 #endif /* DEBUG_ON */
-                client_started_sending = TRUE;
+        syslog(LOG_INFO, "cpu%d: connections %llu, received %llu, sent %llu", cpu,
+            stats->connections, stats->bytes_received, stats->bytes_sent);
+    }
+
+#ifdef DEBUG_ON
+    printf("admission: accepted %llu, rejected %llu (limit) %llu (memory), shed packets %llu, "
+        "accept errors %llu, memory in use %llu\n", admission.accepted, admission.rejected_connections,
+        admission.rejected_memory, admission.shed_packets, admission.accept_errors, memory_in_use);
+#endif /* DEBUG_ON */
+    syslog(LOG_INFO, "admission: accepted %llu, rejected %llu (limit) %llu (memory), shed packets %llu, "
+        "accept errors %llu, memory in use %llu", admission.accepted, admission.rejected_connections,
+        admission.rejected_memory, admission.shed_packets, admission.accept_errors, memory_in_use);
+
+#ifdef DEBUG_ON
+    printf("subscribers: active %lu, total %llu, delivered %llu, dropped %llu\n", num_subscribers,
+        subscription.subscriptions, subscription.delivered, subscription.dropped);
+#endif /* DEBUG_ON */
+    syslog(LOG_INFO, "subscribers: active %lu, total %llu, delivered %llu, dropped %llu", num_subscribers,
+        subscription.subscriptions, subscription.delivered, subscription.dropped);
+
+#ifdef DEBUG_ON
+    printf("timeouts: idle %llu, read %llu, write %llu\n", timeouts.idle, timeouts.read, timeouts.write);
+#endif /* DEBUG_ON */
+    syslog(LOG_INFO, "timeouts: idle %llu, read %llu, write %llu", timeouts.idle, timeouts.read, timeouts.write);
+}
+
+Boolean chargeMemory(U64 bytes)
+/**
+ * @brief Reserves bytes from the global memory budget
+ *
+ * @returns FALSE (and reserves nothing) if the budget would be exceeded
+ */
+{
+    U64 in_use = __atomic_add_fetch(&memory_in_use, bytes, __ATOMIC_RELAXED);
+
+    if ((global_memory_budget != 0) && (in_use > global_memory_budget))
+    {
+        __atomic_sub_fetch(&memory_in_use, bytes, __ATOMIC_RELAXED);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+void releaseMemory(U64 bytes)
+{
+    __atomic_sub_fetch(&memory_in_use, bytes, __ATOMIC_RELAXED);
+}
+
+Boolean growConnectionBuffer(task_params* conn, size_t min_size)
+/**
+ * @brief Grows the packet buffer of a connection to at least min_size bytes,
+ * at least doubling it, within the per-connection and global memory budgets
+ *
+ * @returns FALSE if a budget would be exceeded or realloc() failed
+ */
+{
+    size_t new_size = conn->buffer_size * 2U;
+    U8* new_buffer;
+
+    if (new_size < min_size)
+    {
+        new_size = min_size;
+    }
+
+    if (new_size > connection_memory_budget)
+    {
+        if ((conn->buffer_size >= connection_memory_budget) || (min_size > connection_memory_budget))
+        {
+            return FALSE;
+        }
+
+        new_size = connection_memory_budget;
+    }
+
+    if (chargeMemory(new_size - conn->buffer_size) == FALSE)
+    {
+        return FALSE;
+    }
+
+    if ((new_buffer = (U8*)realloc(conn->buffer, new_size)) == NULL)
+    {
+        releaseMemory(new_size - conn->buffer_size);
+        return FALSE;
+    }
+
+    conn->buffer = new_buffer;
+    conn->buffer_size = new_size;
+    return TRUE;
+}
+
+int admitConnection(int conf_fd)
+/**
+ * @brief Admission control for an accepted connection. A rejected
+ * connection is closed right away instead of queueing more work.
+ *
+ * @returns Free slot reserved for the connection, FAIL if it was rejected
+ */
+{
+    int slot = FAIL;
+
+    if (__atomic_load_n(&active_connections, __ATOMIC_RELAXED) >= max_connections)
+    {
+        admission.rejected_connections++;
+        close(conf_fd);
+        return FAIL;
+    }
+
+    /* Every connection starts with a DATA_BLOCK_SIZE packet buffer */
+    if (chargeMemory(DATA_BLOCK_SIZE) == FALSE)
+    {
+        __atomic_add_fetch(&admission.rejected_memory, 1, __ATOMIC_RELAXED);
+        close(conf_fd);
+        return FAIL;
+    }
+
+    for (int i = 1; i < NUM_THREADS; i++)
+    {
+        if (__atomic_load_n(&t_params[i].active, __ATOMIC_ACQUIRE) == FALSE)
+        {
+            /* Reap the thread that served the slot before */
+            if (t_params[i].joinable == TRUE)
+            {
+                pthread_join(threads[i], NULL);
+                t_params[i].joinable = FALSE;
+            }
+
+            slot = i;
+            break;
+        }
+    }
+
+    if (slot == FAIL)
+    {
+        releaseMemory(DATA_BLOCK_SIZE);
+        admission.rejected_connections++;
+        close(conf_fd);
+        return FAIL;
+    }
+
+    admission.accepted++;
+    __atomic_add_fetch(&active_connections, 1, __ATOMIC_RELAXED);
+    t_params[slot].conf_fd = conf_fd;
+    t_params[slot].shed = FALSE;
+    t_params[slot].subscribe = FALSE;
+    t_params[slot].framed = FALSE;
+    t_params[slot].chan = &channels[0];
+    t_params[slot].timed_out = FALSE;
+    t_params[slot].active = TRUE;
+    t_params[slot].joinable = TRUE;
+    return slot;
+}
+
+void shedPendingConnection(int listen_fd)
+/**
+ * @brief Out of descriptors: frees the spare descriptor to accept and close
+ * the oldest pending connection, so clients get a reset instead of hanging
+ * in the backlog, then backs off before accepting again
+ */
+{
+    int shed_fd;
+
+    if (spare_fd != FAIL)
+    {
+        close(spare_fd);
+        if ((shed_fd = accept(listen_fd, NULL, NULL)) != FAIL)
+        {
+            close(shed_fd);
+            admission.rejected_connections++;
+        }
+
+        spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+
+    usleep(US_TO_MS(ACCEPT_BACKOFF_MS));
+}
+
+void setConnectionPhase(task_params* conn, conn_phase phase)
+/**
+ * @brief Switches the deadline the connection timer enforces. The timer
+ * stays armed across phases, it re-evaluates the deadline when it fires.
+ */
+{
+    U64 now_ms = timer_wheel_now_ms();
+
+    __atomic_store_n(&conn->phase_start_ms, now_ms, __ATOMIC_RELAXED);
+    __atomic_store_n(&conn->last_activity_ms, now_ms, __ATOMIC_RELAXED);
+    __atomic_store_n(&conn->phase, phase, __ATOMIC_RELEASE);
+}
+
+void touchConnection(task_params* conn)
+/**
+ * @brief Records progress, pushes the idle and write deadlines out without
+ * touching the wheel
+ */
+{
+    __atomic_store_n(&conn->last_activity_ms, timer_wheel_now_ms(), __ATOMIC_RELAXED);
+}
+
+U64 connectionDeadline(task_params* conn, U64** counter)
+/**
+ * @returns Absolute deadline of the current phase, 0 if it has none.
+ * counter is set to the timeout counter to bump once it passes.
+ */
+{
+    conn_phase phase = __atomic_load_n(&conn->phase, __ATOMIC_ACQUIRE);
+    U64 last_activity_ms = __atomic_load_n(&conn->last_activity_ms, __ATOMIC_RELAXED);
+    U64 phase_start_ms = __atomic_load_n(&conn->phase_start_ms, __ATOMIC_RELAXED);
+    U64 deadline = 0;
+
+    switch (phase)
+    {
+        case CONN_RECEIVING:
+            if (idle_timeout_ms != 0)
+            {
+                deadline = last_activity_ms + idle_timeout_ms;
+                *counter = &timeouts.idle;
+            }
+
+            if ((read_timeout_ms != 0) && ((deadline == 0) || ((phase_start_ms + read_timeout_ms) < deadline)))
+            {
+                deadline = phase_start_ms + read_timeout_ms;
+                *counter = &timeouts.read;
+            }
+            break;
+
+        case CONN_SENDING:
+            if (write_timeout_ms != 0)
+            {
+                deadline = last_activity_ms + write_timeout_ms;
+                *counter = &timeouts.write;
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    return deadline;
+}
+
+uint64_t connectionTimerExpired(void* context, uint64_t now_ms)
+/**
+ * @brief Timer wheel callback, shuts a connection that missed its deadline
+ * down so the worker blocked in recv()/send() returns and frees the slot
+ *
+ * @returns Milliseconds until the deadline is checked again, 0 once fired
+ */
+{
+    task_params* conn = (task_params*)context;
+    U64* counter = NULL;
+    U64 deadline = connectionDeadline(conn, &counter);
+
+    if (deadline == 0)
+    {
+        return TIMEOUT_RECHECK_MS;
+    }
+
+    if (now_ms < deadline)
+    {
+        return deadline - now_ms;
+    }
+
+    __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&conn->timed_out, TRUE, __ATOMIC_RELEASE);
+    TRACE_PROBE1(connection__timeout, conn->conf_fd);
+    shutdown(conn->conf_fd, SHUT_RDWR);
+    return 0;
+}
+
+void timer_task(void*)
+{
+    while (timestamp_thread_exit == FALSE)
+    {
+        usleep(US_TO_MS(TIMER_WHEEL_TICK_MS));
+        timer_wheel_advance(&connection_timers, timer_wheel_now_ms());
+    }
+}
+
+void printClientIpAddress(Boolean open_connection, task_params* t_arg)
+{
+    struct sockaddr_in *sock_addr = (struct sockaddr_in*)&t_arg->client_addr;
+    if (open_connection == TRUE)
+    {
+        if (t_arg->client_addr.ss_family == AF_UNIX)
+        {
+            t_arg->client_ip = (char*)unix_socket_path;
+        }
+        else
+        {
+            t_arg->client_ip = inet_ntoa(sock_addr->sin_addr);
+        }
+
+#ifdef DEBUG_ON
+        printf("Accepted connection from %s\n", t_arg->client_ip);
+#endif /* DEBUG_ON */
+        syslog(LOG_INFO, "Accepted connection from %s", t_arg->client_ip);
+    }
+    else
+    {
+        if ((t_arg->client_ip) != NULL)
+        {
+#ifdef DEBUG_ON
+            printf("Closed connection from %s\n", t_arg->client_ip);
+#endif /* DEBUG_ON */
+            syslog(LOG_INFO, "Closed connection from %s", t_arg->client_ip);
+        }
+    }
+}
+
+int waitForListener(void)
+/**
+ * @brief Blocks until the TCP or the UNIX listener has a pending connection.
+ * SIGINT, SIGTERM and SIGUSR1 are unblocked only while waiting.
+ *
+ * @returns The ready listening socket, FAIL if interrupted by a signal
+ */
+{
+    struct pollfd listeners[2];
+    nfds_t num_listeners = 1;
+
+    listeners[0].fd = listen_fd;
+    listeners[0].events = POLLIN;
+    if (unix_listen_fd != FAIL)
+    {
+        listeners[1].fd = unix_listen_fd;
+        listeners[1].events = POLLIN;
+        num_listeners++;
+    }
+
+    if (ppoll(listeners, num_listeners, NULL, &listener_sigmask) == FAIL)
+    {
+        if (errno != EINTR)
+        {
+            printf("ppoll: %s\n", strerror(errno));
+        }
+
+        return FAIL;
+    }
+
+    for (nfds_t i = 0; i < num_listeners; i++)
+    {
+        if (listeners[i].revents & POLLIN)
+        {
+            return listeners[i].fd;
+        }
+    }
+
+    return FAIL;
+}
+
+int acceptConnection(struct sockaddr_storage* client_addr, int listen_fd)
+{
+    int configured_fd;
+    socklen_t client_addr_size;
+
+    client_addr_size = sizeof(*client_addr);
+    memset(client_addr, 0, client_addr_size);
+    if ((configured_fd = accept(listen_fd, (struct sockaddr*)client_addr, &client_addr_size)) == FAIL)
+    {
+        switch (errno)
+        {
+            case EINTR:
+                /* Interrupted by SIGUSR1, let the caller handle it and retry */
+            case EAGAIN:
+            case ECONNABORTED:
+            case EPROTO:
+                /* Transient, the client gave up before we got to it */
+                break;
+
+            case EMFILE:
+            case ENFILE:
+            case ENOBUFS:
+            case ENOMEM:
+                /* Overloaded, shed instead of dying with the load */
+                admission.accept_errors++;
+                shedPendingConnection(listen_fd);
+                break;
+
+            default:
+                printf("accept: %s\n", strerror(errno));
+                admission.accept_errors++;
+                break;
+        }
+
+        return FAIL;
+    }
+
+    return configured_fd;
+}
+
+ssize_t receiveFromClient(int configured_fd, U8* buf, size_t len, int* passed_fd)
+/**
+ * @brief recv() wrapper, local connections use recvmsg() to pick up a
+ * descriptor passed with SCM_RIGHTS. A previously passed descriptor that
+ * was not consumed is replaced.
+ *
+ * @returns Number of bytes received, 0 on orderly shutdown, FAIL on error
+ */
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr* cmsg;
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    ssize_t received;
+
+    if (passed_fd == NULL)
+    {
+        return recv(configured_fd, buf, len, 0);
+    }
+
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    if ((received = recvmsg(configured_fd, &msg, MSG_CMSG_CLOEXEC)) <= 0)
+    {
+        return received;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS))
+        {
+            if (*passed_fd != FAIL)
+            {
+                close(*passed_fd);
+            }
+
+            memcpy(passed_fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+
+    return received;
+}
+
+Boolean receiveExactly(task_params* conn, U8* buf, size_t len, int* passed_fd)
+/**
+ * @brief Receives exactly len bytes in as few recv() calls as the peer allows
+ *
+ * @returns FALSE if the peer went away (or timed out) first
+ */
+{
+    ssize_t received;
+
+    while (len > 0)
+    {
+        received = receiveFromClient(conn->conf_fd, buf, len, passed_fd);
+        if (received <= 0)
+        {
+            if ((received == FAIL) && (errno == EINTR))
+            {
+                continue;
+            }
+
+            if (received == FAIL)
+            {
+                printf("recv_read: %s\n", strerror(errno));
+            }
+
+            return FALSE;
+        }
+
+        touchConnection(conn);
+        buf += received;
+        len -= received;
+    }
+
+    return TRUE;
+}
+
+Boolean receiveFramedRecord(task_params* conn, size_t* packet_len, int* passed_fd)
+/**
+ * @brief Receives one record of FRAMING_CMD mode: a FRAME_HEADER_SIZE big
+ * endian length followed by that many payload bytes. The payload goes
+ * straight into a buffer of the right size, nothing is scanned for a
+ * delimiter or parsed as a command so it may hold any byte.
+ *
+ * A record that exceeds the memory budget or is cut short is dropped,
+ * the stream cannot be resynchronized after it.
+ */
+{
+    U8 header[FRAME_HEADER_SIZE];
+    size_t record_len;
+
+    if (receiveExactly(conn, header, FRAME_HEADER_SIZE, passed_fd) == FALSE)
+    {
+        return FALSE;
+    }
+
+    client_started_sending = TRUE;
+    record_len = ((size_t)header[0] << 24) | ((size_t)header[1] << 16) | ((size_t)header[2] << 8) | (size_t)header[3];
+
+    if ((record_len > conn->buffer_size) && (growConnectionBuffer(conn, record_len) == FALSE))
+    {
+        printf("receiveFramedRecord(): record exceeds memory budget, dropping it\n");
+        __atomic_add_fetch(&admission.shed_packets, 1, __ATOMIC_RELAXED);
+        conn->shed = TRUE;
+        return FALSE;
+    }
+
+    if (receiveExactly(conn, conn->buffer, record_len, passed_fd) == FALSE)
+    {
+        conn->shed = TRUE;
+        return FALSE;
+    }
+
+    *packet_len = record_len;
+    return TRUE;
+}
+
+void setupChannels(void)
+{
+    for (U32 i = 0; i < SOCKET_CHANNELS_MAX; i++)
+    {
+        memset(&channels[i], 0, sizeof(channel));
+        pthread_mutex_init(&channels[i].file_mutex, NULL);
+        pthread_mutex_init(&channels[i].subscribers_mutex, NULL);
+        if (i == 0)
+        {
+            snprintf(channels[i].path, CHANNEL_PATH_MAX, "%s", SOCKET_DATA_FILEPATH);
+            snprintf(channels[i].frame_path, CHANNEL_PATH_MAX, "%s", FRAME_LOG_FILEPATH);
+        }
+        else
+        {
+            snprintf(channels[i].path, CHANNEL_PATH_MAX, "%s%lu", SOCKET_DATA_FILEPATH, i);
+            snprintf(channels[i].frame_path, CHANNEL_PATH_MAX, "%s%lu", FRAME_LOG_FILEPATH, i);
+        }
+    }
+}
+
+Boolean selectChannel(task_params* conn, const char* cmd)
+/**
+ * @brief Handles the "AESDSOCKET_CHANNEL:<n>" handshake, packets that
+ * follow on the connection go to (and are echoed from) channel n
+ */
+{
+    unsigned int index;
+
+    if ((sscanf(cmd + strlen(CHANNEL_CMD), "%u", &index) != 1) || (index >= SOCKET_CHANNELS_MAX))
+    {
+        printf("Invalid channel command: %s", cmd);
+        return FALSE;
+    }
+
+    conn->chan = &channels[index];
+    return TRUE;
+}
+
+FILE* openChannel(channel* chan)
+/**
+ * @brief Opens the channel log for appending. Caller holds chan->file_mutex.
+ *
+ * The stream is unbuffered so every appendPacket() is a single write(2),
+ * which aesdchar turns into one entry however large the packet is.
+ */
+{
+    FILE* fstream;
+
+    if ((fstream = fopen(chan->path, "a")) == NULL)
+    {
+        printf("fstream %s: %s\n", chan->path, strerror(errno));
+        return NULL;
+    }
+
+    setvbuf(fstream, NULL, _IONBF, 0);
+    chan->used = TRUE;
+    return fstream;
+}
+
+void lockDataFile(channel* chan)
+/**
+ * @brief Takes the channel's file_mutex. The lock__wait / lock__acquired
+ * probe pair gives the wait time, lock__acquired / lock__released the hold time.
+ */
+{
+    TRACE_PROBE1(lock__wait, chan);
+    pthread_mutex_lock(&chan->file_mutex);
+    TRACE_PROBE1(lock__acquired, chan);
+}
+
+void unlockDataFile(channel* chan)
+{
+    pthread_mutex_unlock(&chan->file_mutex);
+    TRACE_PROBE1(lock__released, chan);
+}
+
+Boolean appendPacket(FILE* fstream, const U8* data, size_t len)
+/**
+ * @brief Common append path for all ingestion sources. Caller holds file_mutex.
+ */
+{
+    TRACE_PROBE2(commit, data, len);
+    if (fwrite(data, sizeof(char), len, fstream) == 0)
+    {
+        printf("ERROR: Nothing is written to data file\n");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+Boolean drainPassedFd(task_params* conn, int passed_fd, size_t* payload_len)
+/**
+ * @brief Reads everything from a descriptor passed over the UNIX socket
+ * (memfd, regular file, pipe...) into the connection buffer, so the bulk
+ * payload is committed as one packet and never goes through the socket
+ * buffers. Called before file_mutex is taken.
+ *
+ * Anything but a regular file is switched to O_NONBLOCK and polled: a peer
+ * that keeps the write end of a pipe open only stalls its own connection,
+ * until the read deadline passes or the socket is shut down (by the
+ * connection timer or teardown()).
+ *
+ * @returns FALSE if the payload exceeds the memory budget, is not at EOF
+ * before the deadline or could not be read; nothing is committed then
+ */
+{
+    struct stat fd_stat;
+    struct pollfd fds[2];
+    U64 deadline_ms = timer_wheel_now_ms() + ((read_timeout_ms != 0) ? read_timeout_ms : READ_TIMEOUT_MS);
+    U64 now_ms;
+    ssize_t read_len;
+    size_t len = 0;
+    int flags;
+
+    if (fstat(passed_fd, &fd_stat) == FAIL)
+    {
+        printf("fstat passed fd: %s\n", strerror(errno));
+        return FALSE;
+    }
+
+    if ((S_ISREG(fd_stat.st_mode) == 0) &&
+        (((flags = fcntl(passed_fd, F_GETFL)) == FAIL) || (fcntl(passed_fd, F_SETFL, flags | O_NONBLOCK) == FAIL)))
+    {
+        printf("fcntl passed fd: %s\n", strerror(errno));
+        return FALSE;
+    }
+
+    fds[0].fd = passed_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = conn->conf_fd;
+    fds[1].events = 0; /* POLLHUP once the socket is shut down */
+
+    while (TRUE)
+    {
+        if ((len == conn->buffer_size) && (growConnectionBuffer(conn, len + DATA_BLOCK_SIZE) == FALSE))
+        {
+            printf("drainPassedFd(): payload exceeds memory budget, dropping it\n");
+            __atomic_add_fetch(&admission.shed_packets, 1, __ATOMIC_RELAXED);
+            return FALSE;
+        }
+
+        read_len = read(passed_fd, &conn->buffer[len], conn->buffer_size - len);
+        if (read_len == 0)
+        {
+            break;
+        }
+
+        if (read_len > 0)
+        {
+            len += read_len;
+            touchConnection(conn);
+            continue;
+        }
+
+        if (errno == EINTR)
+        {
+            continue;
+        }
+
+        if (errno != EAGAIN)
+        {
+            printf("read passed fd: %s\n", strerror(errno));
+            return FALSE;
+        }
+
+        if ((now_ms = timer_wheel_now_ms()) >= deadline_ms)
+        {
+            printf("drainPassedFd(): no EOF on passed fd before the deadline, dropping it\n");
+            __atomic_add_fetch(&timeouts.read, 1, __ATOMIC_RELAXED);
+            return FALSE;
+        }
+
+        if ((poll(fds, 2, (int)(deadline_ms - now_ms)) == FAIL) && (errno != EINTR))
+        {
+            printf("poll passed fd: %s\n", strerror(errno));
+            return FALSE;
+        }
+
+        if (fds[1].revents & (POLLHUP | POLLERR))
+        {
+            return FALSE;
+        }
+    }
+
+    *payload_len = len;
+    return TRUE;
+}
+
+Boolean commitFramedRecord(task_params* conn, size_t record_len)
+/**
+ * @brief Appends a FRAMING_CMD record, header included, to the frame log of
+ * the connection's channel with a single writev(2)
+ *
+ * A failed or short append is cut off again so the log never holds a torn
+ * frame.
+ */
+{
+    Boolean result = TRUE;
+    channel* chan = conn->chan;
+    U8 header[FRAME_HEADER_SIZE];
+    struct iovec iov[2];
+    struct stat frame_stat;
+    int frame_fd;
+
+    encodeFrameHeader(header, (U32)record_len);
+    iov[0].iov_base = header;
+    iov[0].iov_len = FRAME_HEADER_SIZE;
+    iov[1].iov_base = conn->buffer;
+    iov[1].iov_len = record_len;
+    TRACE_PROBE2(packet__received, conn->conf_fd, record_len);
+
+    /* ------------- ENTER CRITICAL SECTION -------------- */
+    lockDataFile(chan);
+
+    if ((frame_fd = open(chan->frame_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) == FAIL)
+    {
+        printf("open %s: %s\n", chan->frame_path, strerror(errno));
+        unlockDataFile(chan);
+        return FALSE;
+    }
+
+    chan->frames_used = TRUE;
+    if (fstat(frame_fd, &frame_stat) == FAIL)
+    {
+        printf("fstat %s: %s\n", chan->frame_path, strerror(errno));
+        result = FALSE;
+    }
+    else if (writev(frame_fd, iov, 2) != (ssize_t)(FRAME_HEADER_SIZE + record_len))
+    {
+        printf("ERROR: Frame not written to %s\n", chan->frame_path);
+        ftruncate(frame_fd, frame_stat.st_size);
+        result = FALSE;
+    }
+    else
+    {
+        TRACE_PROBE2(commit, conn->buffer, record_len);
+        publishRecord(chan, conn->buffer, record_len, FALSE, TRUE);
+        accountCpuStats(0, record_len, 0);
+    }
+
+    close(frame_fd);
+    unlockDataFile(chan);
+    /* ------------- EXIT CRITICAL SECTION -------------- */
+
+    return result;
+}
+
+Boolean readClientDataToFile(task_params* conn, long *offset)
+{
+    Boolean result = TRUE;
+    FILE* fstream;
+    U8* buf;
+    size_t packet_len = 0;
+    int passed_fd = FAIL;
+    Boolean passed_payload = FALSE;
+    ssize_t received;
+    Boolean is_local = (conn->client_addr.ss_family == AF_UNIX) ? TRUE : FALSE;
+
+    /* Buffer the whole packet so that it is committed with a single lock hold */
+    while (TRUE)
+    {
+        if (conn->framed == TRUE)
+        {
+            result = receiveFramedRecord(conn, &packet_len, (is_local == TRUE) ? &passed_fd : NULL);
+            break;
+        }
+
+        /* Keep one byte for the terminator the command parsing below relies on */
+        if (((packet_len + 1) >= conn->buffer_size) && (growConnectionBuffer(conn, packet_len + 2) == FALSE))
+        {
+            printf("readClientDataToFile(): packet exceeds memory budget, dropping it\n");
+            __atomic_add_fetch(&admission.shed_packets, 1, __ATOMIC_RELAXED);
+            conn->shed = TRUE;
+            result = FALSE;
+            break;
+        }
+
+        received = receiveFromClient(conn->conf_fd, &conn->buffer[packet_len], sizeof(char),
+                                     (is_local == TRUE) ? &passed_fd : NULL);
+        if (received <= 0)
+        {
+            if (received == FAIL)
+            {
+                printf("recv_read: %s\n", strerror(errno));
+                printf("configured_fd: %d\n", conn->conf_fd);
+            }
+
+            /* Peer went away, keep whatever was received so far unless it stalled */
+            if (__atomic_load_n(&conn->timed_out, __ATOMIC_ACQUIRE) == TRUE)
+            {
+                conn->shed = TRUE;
+            }
+
+            result = FALSE;
+            break;
+        }
+
+        touchConnection(conn);
+
+        if (client_started_sending == FALSE)
+        {
+#ifdef DEBUG_ON
+            printf("readClientDataToFile(): Started timestamping now\n");
+#endif /* DEBUG_ON */
+            client_started_sending = TRUE;
+        }
+
+        packet_len++;
+        if (conn->buffer[packet_len - 1] == '\n')
+        {
+            conn->buffer[packet_len] = '\0';
+            if (strcmp((char*)conn->buffer, FRAMING_CMD) == 0)
+            {
+                /* Framing handshake, records that follow carry a length header */
+                conn->framed = TRUE;
+                packet_len = 0;
+                continue;
+            }
+
+            if (strcmp((char*)conn->buffer, FRAMED_SUBSCRIBE_CMD) == 0)
+            {
+                /* Subscription with every record behind a length header, nothing to commit */
+                conn->framed = TRUE;
+                conn->subscribe = TRUE;
+                packet_len = 0;
+                break;
+            }
+
+            if (strncmp((char*)conn->buffer, CHANNEL_CMD, strlen(CHANNEL_CMD)) != 0)
+            {
+                break;
+            }
+
+            /* Channel handshake, the packet to commit follows on the same connection */
+            if (selectChannel(conn, (char*)conn->buffer) == FALSE)
+            {
+                /* Nothing to commit and nothing to echo */
+                conn->shed = TRUE;
+                result = FALSE;
+                break;
+            }
+
+            packet_len = 0;
+        }
+    }
+
+    if ((conn->framed == TRUE) && (conn->subscribe == FALSE) && (conn->shed == FALSE) && (result == TRUE))
+    {
+        /* Framed payloads are stored with their boundaries and never parsed as commands */
+        if (passed_fd != FAIL)
+        {
+            close(passed_fd);
+        }
+
+        return commitFramedRecord(conn, packet_len);
+    }
+
+    if ((conn->shed == TRUE) || (packet_len == 0))
+    {
+        if (passed_fd != FAIL)
+        {
+            close(passed_fd);
+        }
+
+        return result;
+    }
+
+    buf = conn->buffer;
+    buf[packet_len] = '\0';
+    TRACE_PROBE2(packet__received, conn->conf_fd, packet_len);
+
+    if (strcmp((char*)buf, SUBSCRIBE_CMD) == 0)
+    {
+        /* Nothing to commit, the worker turns into a subscriber */
+        conn->subscribe = TRUE;
+        if (passed_fd != FAIL)
+        {
+            close(passed_fd);
+        }
+
+        return TRUE;
+    }
+
+    if ((passed_fd != FAIL) && (strncmp((char*)buf, SENDFD_CMD, strlen(SENDFD_CMD)) == 0))
+    {
+        /* Bulk payload passed by descriptor, the command line itself is not stored */
+        passed_payload = drainPassedFd(conn, passed_fd, &packet_len);
+        close(passed_fd);
+        passed_fd = FAIL;
+        if (passed_payload == FALSE)
+        {
+            conn->shed = TRUE;
+            return FALSE;
+        }
+
+        buf = conn->buffer; /* may have been reallocated */
+        if (packet_len == 0)
+        {
+            return TRUE;
+        }
+    }
+
+    /* ------------- ENTER CRITICAL SECTION -------------- */
+    lockDataFile(conn->chan);
+
+    if ((fstream = openChannel(conn->chan)) == NULL)
+    {
+        unlockDataFile(conn->chan);
+        if (passed_fd != FAIL)
+        {
+            close(passed_fd);
+        }
+
+        return FALSE;
+    }
+
+    /* Check if ioctl command requested, a passed payload is never a command */
+    if ((passed_payload == FALSE) && (strncmp((char*)buf, "AESDCHAR_IOCSEEKTO:", 19) == 0))
+    {
+        struct aesd_seekto seekto;
+        long circ_buffer_req_offset;
+        if (sscanf((char*)buf, "AESDCHAR_IOCSEEKTO:%u,%u", &seekto.write_cmd, &seekto.write_cmd_offset) == 2)
+        {
+            /* Get f_pos offset to selected entry & offset */
+            if ((circ_buffer_req_offset = ioctl(fileno(fstream), AESDCHAR_IOCSEEKTO, &seekto)) < 0)
+            {
+                printf("ioctl: %s\n", strerror(errno));
+                result = FALSE;
+            }
+            else
+            {
+                /* IOCTL successful */
+                *offset = circ_buffer_req_offset;
+                result = TRUE;
+            }
+        }
+        else
+        {
+            printf("Invalid ioctl command format\n");
+            result = FALSE;
+        }
+    }
+    else /* Regular write or passed payload requested */
+    {
+        /* Copy bytes from buf to file stream */
+        appendPacket(fstream, buf, packet_len);
+        publishRecord(conn->chan, buf, packet_len, FALSE, FALSE);
+        accountCpuStats(0, packet_len, 0);
+    }
+
+    fflush(fstream);
+    fclose(fstream);
+    unlockDataFile(conn->chan);
+    /* ------------- EXIT CRITICAL SECTION -------------- */
+
+    if (passed_fd != FAIL)
+    {
+        close(passed_fd);
+    }
+
+    return result;
+}
+
+Boolean sendAll(int configured_fd, const U8* buf, size_t len, int flags)
+/**
+ * @brief Sends the whole buffer, retrying on short writes
+ */
+{
+    ssize_t sent;
+
+    while (len > 0)
+    {
+        if ((sent = send(configured_fd, buf, len, MSG_NOSIGNAL | flags)) == FAIL)
+        {
+            if (errno == EINTR)
+            {
+                continue;
             }
 
-            if (strcmp((char*)&buf[internal_cntr], "\n") == PASS)
+            printf("recv_send: %s\n", strerror(errno));
+            return FALSE;
+        }
+
+        buf += sent;
+        len -= sent;
+    }
+
+    return TRUE;
+}
+
+void encodeFrameHeader(U8* header, U32 len)
+/**
+ * @brief Fills in the FRAME_HEADER_SIZE big endian length header of a record
+ */
+{
+    header[0] = (U8)(len >> 24);
+    header[1] = (U8)(len >> 16);
+    header[2] = (U8)(len >> 8);
+    header[3] = (U8)len;
+}
+
+Boolean sendFrameHeader(int configured_fd, U32 len)
+/**
+ * @brief Sends the FRAMING_CMD length header of a record, corked with the
+ * payload that follows
+ */
+{
+    U8 header[FRAME_HEADER_SIZE];
+
+    encodeFrameHeader(header, len);
+    return sendAll(configured_fd, header, FRAME_HEADER_SIZE, MSG_MORE);
+}
+
+Boolean streamCommittedData(task_params* conn, int data_fd, off_t position, off_t committed_len)
+/**
+ * @brief Sends the log data between position and committed_len
+ *
+ * Data goes from the file to the socket with sendfile(), without passing
+ * through conn->buffer. pread() and send() are the fallback for a data file
+ * that cannot be spliced (aesdchar without splice_read).
+ */
+{
+    Boolean result = TRUE;
+    Boolean use_sendfile = TRUE;
+    int configured_fd = conn->conf_fd;
+    U8* buf = conn->buffer;
+    off_t start = position;
+    ssize_t read_len;
+    size_t block_len;
+
+    TRACE_PROBE3(echo__start, configured_fd, position, committed_len);
+
+    while (position < committed_len)
+    {
+        if (use_sendfile == TRUE)
+        {
+            /* Advances position by what was sent */
+            if ((read_len = sendfile(configured_fd, data_fd, &position, (size_t)(committed_len - position))) == FAIL)
             {
-                /* \n is two symbols */
-                internal_cntr++; 
-                data_block_end = TRUE;
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                if (((errno == EINVAL) || (errno == ENOSYS)) && (position == start))
+                {
+                    use_sendfile = FALSE;
+                    continue;
+                }
+
+                printf("sendfile: %s\n", strerror(errno));
+                result = FALSE;
                 break;
             }
         }
+        else
+        {
+            block_len = DATA_BLOCK_SIZE;
+            if ((committed_len - position) < (off_t)block_len)
+            {
+                block_len = (size_t)(committed_len - position);
+            }
+
+            if ((read_len = pread(data_fd, buf, block_len, position)) > 0)
+            {
+                if (sendAll(configured_fd, buf, read_len, 0) == FALSE)
+                {
+                    result = FALSE;
+                    break;
+                }
+
+                position += read_len;
+            }
+        }
+
+        if (read_len <= 0)
+        {
+            /* Nothing more to read, e.g. entries evicted from the char device by another process */
+            break;
+        }
+
+        touchConnection(conn);
+        accountCpuStats(0, 0, read_len);
+    }
 
-        /* ------------- ENTER CRITICAL SECTION -------------- */
-        pthread_mutex_lock(&file_mutex);
+    TRACE_PROBE2(echo__end, configured_fd, position - start);
+    return result;
+}
 
-        if ((fstream = fopen((char*)SOCKET_DATA_FILEPATH, "a")) == NULL)
+Boolean sendFramesBackToClient(task_params* conn)
+/**
+ * @brief Sends the whole frame log of the channel to a framed client. The
+ * log is append only and holds whole frames only, so like the regular data
+ * file it is copied unlocked up to a length snapshot.
+ */
+{
+    Boolean result;
+    channel* chan = conn->chan;
+    int frame_fd;
+    off_t committed_len;
+
+    /* ------------- ENTER CRITICAL SECTION -------------- */
+    lockDataFile(chan);
+    if ((frame_fd = open(chan->frame_path, O_RDONLY | O_CLOEXEC)) == FAIL)
+    {
+        unlockDataFile(chan);
+        if (errno == ENOENT)
         {
-            printf("fstream: %s\n", strerror(errno));
-            data_block_end = TRUE;
-            result = FALSE;
+            /* No framed record committed yet, nothing to echo */
+            return TRUE;
         }
 
-        /* Check if ioctl command requested */
-        if (strncmp((char*)buf, "AESDCHAR_IOCSEEKTO:", 19) == 0)
+        printf("open %s: %s\n", chan->frame_path, strerror(errno));
+        return FALSE;
+    }
+
+    committed_len = lseek(frame_fd, 0, SEEK_END);
+    unlockDataFile(chan);
+    /* ------------- EXIT CRITICAL SECTION -------------- */
+
+    if (committed_len == FAIL)
+    {
+        printf("lseek: %s\n", strerror(errno));
+        result = FALSE;
+    }
+    else
+    {
+        result = streamCommittedData(conn, frame_fd, 0, committed_len);
+    }
+
+    close(frame_fd);
+    return result;
+}
+
+Boolean copyCommittedData(task_params* conn, int data_fd, off_t position, off_t committed_len, size_t* copied_len)
+/**
+ * @brief Copies the data between position and committed_len into the
+ * connection buffer, grown within the memory budgets. Caller holds file_mutex.
+ *
+ * @returns FALSE if the range does not fit the budgets or cannot be read
+ */
+{
+    size_t range_len = (position < committed_len) ? (size_t)(committed_len - position) : 0U;
+    ssize_t read_len;
+
+    *copied_len = 0;
+    if ((range_len > conn->buffer_size) && (growConnectionBuffer(conn, range_len) == FALSE))
+    {
+        printf("copyCommittedData(): echo exceeds memory budget, dropping it\n");
+        __atomic_add_fetch(&admission.shed_packets, 1, __ATOMIC_RELAXED);
+        return FALSE;
+    }
+
+    while (*copied_len < range_len)
+    {
+        read_len = pread(data_fd, &conn->buffer[*copied_len], range_len - *copied_len, position + *copied_len);
+        if (read_len == FAIL)
         {
-            struct aesd_seekto seekto;
-            long circ_buffer_req_offset;
-            if (sscanf((char*)buf, "AESDCHAR_IOCSEEKTO:%u,%u", &seekto.write_cmd, &seekto.write_cmd_offset) == 2)
-            {
-                /* Get f_pos offset to selected entry & offset */
-                if ((circ_buffer_req_offset = ioctl(fileno(fstream), AESDCHAR_IOCSEEKTO, &seekto)) < 0)
-                {
-                    printf("ioctl: %s\n", strerror(errno));
-                    data_block_end = TRUE;
-                    result = FALSE;
-                }
-                else
-                {
-                    /* IOCTL successful */
-                    *offset = circ_buffer_req_offset;
-                    result = TRUE;
-                }
-            }
-            else
+            if (errno == EINTR)
             {
-                printf("Invalid ioctl command format\n");
-                data_block_end = TRUE;
-                result = FALSE;
+                continue;
             }
+
+            printf("pread: %s\n", strerror(errno));
+            return FALSE;
         }
-        else /* Regular write requested */
+
+        if (read_len == 0)
         {
-            /* Copy bytes from buf to file stream */
-            if (fwrite(buf, sizeof(char), internal_cntr, fstream) == 0)
-            {
-                printf("ERROR: Nothing is written to %s", SOCKET_DATA_FILEPATH);
-            }
+            break;
+        }
+
+        *copied_len += read_len;
+    }
+
+    return TRUE;
+}
+
+Boolean sendCopiedData(task_params* conn, size_t len)
+/**
+ * @brief Sends the first len bytes of the connection buffer in
+ * ECHO_SEND_BLOCK_SIZE pieces, each one counting as send progress
+ */
+{
+    size_t sent = 0;
+    size_t block_len;
+
+    TRACE_PROBE3(echo__start, conn->conf_fd, 0, len);
+    while (sent < len)
+    {
+        block_len = ((len - sent) < ECHO_SEND_BLOCK_SIZE) ? (len - sent) : ECHO_SEND_BLOCK_SIZE;
+        if (sendAll(conn->conf_fd, &conn->buffer[sent], block_len, 0) == FALSE)
+        {
+            return FALSE;
         }
 
-        /* Free memory */
-        free(buf);
-        fflush(fstream);
-        fclose(fstream);
-        pthread_mutex_unlock(&file_mutex);
-        /* ------------- EXIT CRITICAL SECTION -------------- */
+        sent += block_len;
+        touchConnection(conn);
+        accountCpuStats(0, 0, block_len);
+    }
+
+    TRACE_PROBE2(echo__end, conn->conf_fd, sent);
+    return TRUE;
+}
+
+Boolean sendDataBackToClient(task_params* conn, long *offset)
+/**
+ * @brief Streams committed data of a channel from *offset to the client
+ *
+ * file_mutex is never held while sending, a slow client only slows down
+ * its own thread.
+ *
+ * With the regular data file, the lock is only held long enough to
+ * snapshot the committed length. The file is append only, so data below
+ * that length never moves and is sent straight from the file.
+ *
+ * aesdchar offsets are relative to the oldest entry, so an entry evicted
+ * by a concurrent writer shifts every offset and an unlocked read would
+ * skip or repeat data. With the char device the range is copied into the
+ * connection buffer under the lock and sent from there.
+ *
+ * A framed connection gets the channel's frame log instead, one frame per
+ * record as stored.
+ */
+{
+    Boolean result = TRUE;
+    channel* chan = conn->chan;
+    int data_fd;
+    off_t committed_len;
+#if USE_AESD_CHAR_DEVICE == 1
+    size_t copied_len = 0;
+#endif /* USE_AESD_CHAR_DEVICE == 1 */
+
+    if (conn->framed == TRUE)
+    {
+        return sendFramesBackToClient(conn);
+    }
+
+    if ((data_fd = open(chan->path, O_RDONLY)) == FAIL)
+    {
+        printf("open %s: %s\n", chan->path, strerror(errno));
+        return FALSE;
+    }
+
+    /* ------------- ENTER CRITICAL SECTION -------------- */
+    lockDataFile(chan);
+    committed_len = lseek(data_fd, 0, SEEK_END);
+#if USE_AESD_CHAR_DEVICE == 1
+    if (committed_len != FAIL)
+    {
+        result = copyCommittedData(conn, data_fd, (off_t)*offset, committed_len, &copied_len);
+    }
+#endif /* USE_AESD_CHAR_DEVICE == 1 */
+    unlockDataFile(chan);
+    /* ------------- EXIT CRITICAL SECTION -------------- */
+
+    if (committed_len == FAIL)
+    {
+        printf("lseek: %s\n", strerror(errno));
+        result = FALSE;
+    }
+    else if (result == TRUE)
+    {
+#if USE_AESD_CHAR_DEVICE == 1
+        result = sendCopiedData(conn, copied_len);
+#else /* USE_AESD_CHAR_DEVICE == 0 */
+        result = streamCommittedData(conn, data_fd, (off_t)*offset, committed_len);
+#endif /* USE_AESD_CHAR_DEVICE == 1 */
     }
 
+    close(data_fd);
     return result;
 }
 
-Boolean sendDataBackToClient(int configured_fd, long *offset)
+void releaseRecord(published_record* record)
+{
+    if (__atomic_sub_fetch(&record->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        free(record);
+    }
+}
+
+void publishRecord(channel* chan, const U8* data, size_t len, Boolean add_newline, Boolean framed_record)
+/**
+ * @brief Pushes a just committed record to every subscriber queue of the channel
+ * (framed records only to framed subscribers, others read a newline stream)
+ *
+ * Called with the channel's file_mutex held so subscribers see records in log order.
+ * The record is copied once and shared; per subscriber the cost is one
+ * pointer enqueue, or a drop if that subscriber's queue is full.
+ */
+{
+    published_record* record;
+    subscriber* sub;
+    size_t record_len = len + ((add_newline == TRUE) ? 1U : 0U);
+
+    if (__atomic_load_n(&chan->num_subscribers, __ATOMIC_RELAXED) == 0)
+    {
+        return;
+    }
+
+    if ((record = (published_record*)malloc(sizeof(published_record) + record_len)) == NULL)
+    {
+        __atomic_add_fetch(&subscription.dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    memcpy(record->data, data, len);
+    if (add_newline == TRUE)
+    {
+        record->data[len] = '\n';
+    }
+
+    record->len = record_len;
+    record->refcount = 1; /* held by the publisher until fan-out is done */
+
+    pthread_mutex_lock(&chan->subscribers_mutex);
+    for (U32 i = 0; i < chan->num_subscribers; i++)
+    {
+        sub = chan->subscribers[i];
+        if ((framed_record == TRUE) && (sub->framed == FALSE))
+        {
+            continue;
+        }
+
+        pthread_mutex_lock(&sub->lock);
+        if ((sub->count == SUBSCRIBER_QUEUE_DEPTH) ||
+            ((sub->queued_bytes + record_len) > SUBSCRIBER_QUEUE_BYTES))
+        {
+            sub->dropped++;
+            __atomic_add_fetch(&subscription.dropped, 1, __ATOMIC_RELAXED);
+        }
+        else
+        {
+            __atomic_add_fetch(&record->refcount, 1, __ATOMIC_RELAXED);
+            sub->records[(sub->head + sub->count) % SUBSCRIBER_QUEUE_DEPTH] = record;
+            sub->count++;
+            sub->queued_bytes += record_len;
+            pthread_cond_signal(&sub->ready);
+        }
+
+        pthread_mutex_unlock(&sub->lock);
+    }
+
+    pthread_mutex_unlock(&chan->subscribers_mutex);
+    releaseRecord(record);
+}
+
+Boolean addSubscriber(channel* chan, subscriber* sub, Boolean framed)
+/**
+ * @brief Registers a subscriber, its queue is charged to the memory budget
+ */
+{
+    if (chargeMemory(SUBSCRIBER_QUEUE_BYTES) == FALSE)
+    {
+        __atomic_add_fetch(&admission.rejected_memory, 1, __ATOMIC_RELAXED);
+        return FALSE;
+    }
+
+    memset(sub, 0, sizeof(subscriber));
+    pthread_mutex_init(&sub->lock, NULL);
+    pthread_cond_init(&sub->ready, NULL);
+    sub->framed = framed;
+
+    pthread_mutex_lock(&chan->subscribers_mutex);
+    chan->subscribers[chan->num_subscribers] = sub;
+    __atomic_add_fetch(&chan->num_subscribers, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&num_subscribers, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&subscription.subscriptions, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&chan->subscribers_mutex);
+
+    return TRUE;
+}
+
+void removeSubscriber(channel* chan, subscriber* sub)
+{
+    pthread_mutex_lock(&chan->subscribers_mutex);
+    for (U32 i = 0; i < chan->num_subscribers; i++)
+    {
+        if (chan->subscribers[i] == sub)
+        {
+            chan->subscribers[i] = chan->subscribers[chan->num_subscribers - 1];
+            __atomic_sub_fetch(&chan->num_subscribers, 1, __ATOMIC_RELAXED);
+            __atomic_sub_fetch(&num_subscribers, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&chan->subscribers_mutex);
+
+    /* No publisher can reach the queue any more, drop what is left */
+    while (sub->count > 0)
+    {
+        releaseRecord(sub->records[sub->head]);
+        sub->head = (sub->head + 1) % SUBSCRIBER_QUEUE_DEPTH;
+        sub->count--;
+    }
+
+    pthread_cond_destroy(&sub->ready);
+    pthread_mutex_destroy(&sub->lock);
+    releaseMemory(SUBSCRIBER_QUEUE_BYTES);
+}
+
+Boolean subscriberPeerClosed(int configured_fd)
+{
+    U8 byte;
+    ssize_t received = recv(configured_fd, &byte, sizeof(byte), MSG_PEEK | MSG_DONTWAIT);
+
+    return ((received == 0) || ((received == FAIL) && (errno != EAGAIN) && (errno != EWOULDBLOCK))) ? TRUE : FALSE;
+}
+
+Boolean streamToSubscriber(task_params* conn)
+/**
+ * @brief Keeps the connection open and pushes every newly committed
+ * record to it until the client goes away. Sending happens without any
+ * lock held, a slow subscriber only fills (and drops from) its own queue.
+ */
 {
     Boolean result = TRUE;
-    FILE* fstream;
-    U8* buf = NULL;
-    Boolean data_block_end = FALSE;
-    int internal_cntr;
-    long counter = 0; /* total bytes counter */
+    subscriber* sub = &conn->sub;
+    published_record* record;
+    struct timespec deadline;
 
-    while (data_block_end == FALSE)
+    if (addSubscriber(conn->chan, sub, conn->framed) == FALSE)
     {
-        /* Send data back to client */
-        allocateMemory(&buf, DATA_BLOCK_SIZE);
+        return FALSE;
+    }
 
-        /* ------------- ENTER CRITICAL SECTION -------------- */
-        pthread_mutex_lock(&file_mutex);
-        if ((fstream = fopen((char*)SOCKET_DATA_FILEPATH, "r+")) == NULL)
+    while (timestamp_thread_exit == FALSE)
+    {
+        pthread_mutex_lock(&sub->lock);
+        if (sub->count == 0)
         {
-            printf("fstream: %s\n", strerror(errno));
-            data_block_end = TRUE;
-            result = FALSE;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += SUBSCRIBER_POLL_MS / 1000U;
+            pthread_cond_timedwait(&sub->ready, &sub->lock, &deadline);
         }
 
-        /* Put file pointer before next block */
-        off_t cur_offset = lseek(fileno(fstream), (counter + *offset), SEEK_SET);
-        for (internal_cntr = 0; internal_cntr < DATA_BLOCK_SIZE; internal_cntr++)
+        if (sub->count == 0)
         {
-            counter++;
-            if (fread(&buf[internal_cntr], sizeof(char), sizeof(char), fstream) == 0)
+            pthread_mutex_unlock(&sub->lock);
+
+            /* Idle, notice clients that went away without a send failing */
+            if (subscriberPeerClosed(conn->conf_fd) == TRUE)
             {
-                data_block_end = TRUE;
                 break;
             }
+
+            continue;
         }
 
-        if (send(configured_fd, buf, internal_cntr, 0) == FAIL)
+        record = sub->records[sub->head];
+        sub->head = (sub->head + 1) % SUBSCRIBER_QUEUE_DEPTH;
+        sub->count--;
+        sub->queued_bytes -= record->len;
+        pthread_mutex_unlock(&sub->lock);
+
+        setConnectionPhase(conn, CONN_SENDING);
+        result = TRUE;
+        if (conn->framed == TRUE)
         {
-            printf("recv_send: %s\n", strerror(errno));
-            data_block_end = TRUE;
-            result = FALSE;
+            result = sendFrameHeader(conn->conf_fd, (U32)record->len);
+        }
+
+        if (result == TRUE)
+        {
+            result = sendAll(conn->conf_fd, record->data, record->len, 0);
+        }
+
+        setConnectionPhase(conn, CONN_WAITING);
+        if (result == TRUE)
+        {
+            sub->delivered++;
+            __atomic_add_fetch(&subscription.delivered, 1, __ATOMIC_RELAXED);
+            accountCpuStats(0, 0, record->len);
         }
 
-        free(buf);
-        fflush(fstream);
-        fclose(fstream);
-        pthread_mutex_unlock(&file_mutex);
-        /* ------------- EXIT CRITICAL SECTION -------------- */
+        releaseRecord(record);
+        if (result == FALSE)
+        {
+            break;
+        }
     }
 
+#ifdef DEBUG_ON
+    printf("Subscriber %s: delivered %llu, dropped %llu\n", conn->client_ip, sub->delivered, sub->dropped);
+#endif /* DEBUG_ON */
+    syslog(LOG_INFO, "Subscriber %s: delivered %llu, dropped %llu", conn->client_ip, sub->delivered, sub->dropped);
+    removeSubscriber(conn->chan, sub);
+
     return result;
 }
 
@@ -464,15 +2452,62 @@ Boolean aesdsocket_task(void* arg)
     Boolean result = TRUE;
     task_params* arguments = (task_params*)arg;
     long offset = 0;
+    U64* counter;
+    U64 deadline;
 
     printClientIpAddress(TRUE, arguments);
-    result &= readClientDataToFile(arguments->conf_fd, &offset);
-    result &= sendDataBackToClient(arguments->conf_fd, &offset);
+
+    /* Allocated by the (already pinned) worker itself so first touch places it on the local node */
+    arguments->buffer_size = DATA_BLOCK_SIZE;
+    if (allocateMemory(&arguments->buffer, DATA_BLOCK_SIZE) == FALSE)
+    {
+        result = FALSE;
+    }
+    else
+    {
+        accountCpuStats(1, 0, 0);
+        setConnectionPhase(arguments, CONN_RECEIVING);
+        if (timers_enabled == TRUE)
+        {
+            deadline = connectionDeadline(arguments, &counter);
+            timer_wheel_arm(&connection_timers, &arguments->timer,
+                (deadline != 0) ? (deadline - arguments->phase_start_ms) : TIMEOUT_RECHECK_MS);
+        }
+
+        result &= readClientDataToFile(arguments, &offset);
+        if (arguments->subscribe == TRUE)
+        {
+            setConnectionPhase(arguments, CONN_WAITING);
+            result &= streamToSubscriber(arguments);
+        }
+        else if (arguments->shed == FALSE)
+        {
+            setConnectionPhase(arguments, CONN_SENDING);
+            result &= sendDataBackToClient(arguments, &offset);
+        }
+
+        /* No shutdown() may hit the descriptor once it is closed and reused */
+        timer_wheel_cancel(&connection_timers, &arguments->timer);
+        if (arguments->timed_out == TRUE)
+        {
+#ifdef DEBUG_ON
+            printf("Connection from %s timed out\n", arguments->client_ip);
+#endif /* DEBUG_ON */
+            syslog(LOG_INFO, "Connection from %s timed out", arguments->client_ip);
+        }
+    }
 
     /* Data block complete, close current connection */
+    free(arguments->buffer);
+    arguments->buffer = NULL;
+    releaseMemory(arguments->buffer_size);
     close(arguments->conf_fd);
     printClientIpAddress(FALSE, arguments);
 
+    /* Hand the slot back to the accept loop */
+    __atomic_sub_fetch(&active_connections, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&arguments->active, FALSE, __ATOMIC_RELEASE);
+
     return result;
 }
 
@@ -520,30 +2555,162 @@ void timestamp_task(void*)
     #endif /* DEBUG_ON */
 
             /* ------------- ENTER CRITICAL SECTION -------------- */
-            pthread_mutex_lock(&file_mutex);
+            /* Timestamps go to the default channel only */
+            lockDataFile(&channels[0]);
 
-            if ((fstream = fopen((char*)SOCKET_DATA_FILEPATH, "a")) == NULL)
+            if ((fstream = openChannel(&channels[0])) == NULL)
             {
-                printf("fstream: %s\n", strerror(errno));
+                unlockDataFile(&channels[0]);
+                continue;
             }
 
             /* Copy bytes from buf to file stream */
-            if (fwrite(timestamp, sizeof(char), sizeof(timestamp), fstream) == 0)
-            {
-                printf("ERROR: Nothing is written to %s", SOCKET_DATA_FILEPATH);
-            }
-
-            fwrite("\n", sizeof(char), 1, fstream);
+            appendPacket(fstream, (const U8*)timestamp, sizeof(timestamp));
+            appendPacket(fstream, (const U8*)"\n", 1);
+            publishRecord(&channels[0], (const U8*)timestamp, sizeof(timestamp), TRUE, FALSE);
 
             /* Free memory */
             fflush(fstream);
             fclose(fstream);
-            pthread_mutex_unlock(&file_mutex);
+            unlockDataFile(&channels[0]);
             /* ------------- EXIT CRITICAL SECTION -------------- */
         }
     }
 }
 
+void commitDatagrams(struct mmsghdr* msgs, unsigned int count)
+/**
+ * @brief Appends a batch of datagrams to the default channel under a
+ * single file_mutex hold
+ *
+ * Every line of a datagram is a packet of its own, committed and published
+ * with one write(2) (the channel stream is unbuffered), so aesdchar entries
+ * and subscriber records have the same boundaries as on the TCP path. A
+ * missing trailing newline is added to keep the datagram boundary, in the
+ * spare byte udp_task() leaves after every buffer.
+ * Empty datagrams are dropped, truncated ones are shed.
+ */
+{
+    FILE* fstream;
+    U8* data;
+    U8* line;
+    U8* newline;
+    size_t len;
+    size_t line_len;
+    U64 bytes = 0;
+
+    /* ------------- ENTER CRITICAL SECTION -------------- */
+    lockDataFile(&channels[0]);
+
+    if ((fstream = openChannel(&channels[0])) == NULL)
+    {
+        unlockDataFile(&channels[0]);
+        return;
+    }
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        data = (U8*)msgs[i].msg_hdr.msg_iov->iov_base;
+        len = msgs[i].msg_len;
+        if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+        {
+            /* Longer than UDP_DATAGRAM_MAX, the tail is gone */
+            __atomic_add_fetch(&admission.shed_packets, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        if (len == 0)
+        {
+            continue;
+        }
+
+        TRACE_PROBE2(packet__received, udp_fd, len);
+        bytes += len;
+
+        if (data[len - 1] != '\n')
+        {
+            data[len] = '\n';
+            len++;
+        }
+
+        for (line = data; line < (data + len); line += line_len)
+        {
+            newline = (U8*)memchr(line, '\n', (data + len) - line);
+            line_len = (size_t)(newline - line) + 1U;
+            appendPacket(fstream, line, line_len);
+            publishRecord(&channels[0], line, line_len, FALSE, FALSE);
+        }
+    }
+
+    fclose(fstream);
+    unlockDataFile(&channels[0]);
+    /* ------------- EXIT CRITICAL SECTION -------------- */
+
+    accountCpuStats(0, bytes, 0);
+}
+
+void udp_task(void*)
+/**
+ * @brief Drains the UDP socket in batches of up to UDP_BATCH_SIZE datagrams
+ * per recvmmsg() call. Datagrams longer than UDP_DATAGRAM_MAX are truncated.
+ */
+{
+    struct mmsghdr* msgs;
+    struct iovec* iovs;
+    U8* buffers;
+    int received;
+
+    /* Allocated here so first touch places them on the worker's node */
+    msgs = (struct mmsghdr*)calloc(UDP_BATCH_SIZE, sizeof(struct mmsghdr));
+    iovs = (struct iovec*)calloc(UDP_BATCH_SIZE, sizeof(struct iovec));
+    buffers = (U8*)calloc(UDP_BATCH_SIZE, UDP_DATAGRAM_MAX + 1U); /* + room for a newline */
+    if ((msgs == NULL) || (iovs == NULL) || (buffers == NULL))
+    {
+        printf("udp_task(): calloc returned NULL!\n");
+        free(msgs);
+        free(iovs);
+        free(buffers);
+        return;
+    }
+
+    for (unsigned int i = 0; i < UDP_BATCH_SIZE; i++)
+    {
+        iovs[i].iov_base = &buffers[i * (UDP_DATAGRAM_MAX + 1U)];
+        iovs[i].iov_len = UDP_DATAGRAM_MAX;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while (timestamp_thread_exit == FALSE)
+    {
+        /* Block for the first datagram, then take whatever else is queued */
+        received = recvmmsg(udp_fd, msgs, UDP_BATCH_SIZE, MSG_WAITFORONE, NULL);
+        if (received == FAIL)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            printf("recvmmsg: %s\n", strerror(errno));
+            break;
+        }
+
+        if (received == 0)
+        {
+            /* Socket shut down by teardown() */
+            break;
+        }
+
+        client_started_sending = TRUE;
+        commitDatagrams(msgs, (unsigned int)received);
+    }
+
+    free(msgs);
+    free(iovs);
+    free(buffers);
+}
+
 /**
  * 
  *      MAIN FUNCTION
@@ -552,8 +2719,9 @@ void timestamp_task(void*)
 int main(int argc, char** argv)
 {
     int conf_fd;
-    struct sockaddr_in client_addr;
-    int i = 1;
+    int ready_fd;
+    int slot;
+    struct sockaddr_storage client_addr;
 
     /* Handle argument(s) */
     parse_args(argc, argv);
@@ -563,19 +2731,67 @@ int main(int argc, char** argv)
     setup();
 
 #if USE_AESD_CHAR_DEVICE == 0
-    pthread_create(&threads[0], NULL, (void*)&timestamp_task, NULL);
+    createThread(&threads[0], (void*)&timestamp_task, NULL, &timestamp_placement);
 #endif /* USE_AESD_CHAR_DEVICE == 0 */
 
-    while(1)
+    if (udp_fd != FAIL)
+    {
+        createThread(&udp_thread, (void*)&udp_task, NULL, &worker_placement);
+    }
+
+    if (timers_enabled == TRUE)
+    {
+        timers_enabled = createThread(&timer_thread, (void*)&timer_task, NULL, &timestamp_placement);
+    }
+
+    /* ppoll() returns EINTR on SIGINT/SIGTERM, the flag is checked before blocking again */
+    while (exit_requested == 0)
     {
-        /* Accept incoming connection */
-        conf_fd = acceptConnection(&client_addr, listen_fd);
-        t_params[i].client_addr = &client_addr;
-        t_params[i].conf_fd = conf_fd;
-        pthread_create(&threads[i], NULL, (void*)aesdsocket_task, (void*)&t_params[i]);
-        i++;
+        if (stats_dump_requested != 0)
+        {
+            stats_dump_requested = 0;
+            printStats();
+        }
+
+        /* Accept incoming connection on whichever listener is ready */
+        if ((ready_fd = waitForListener()) == FAIL)
+        {
+            continue;
+        }
+
+        if (exit_requested != 0)
+        {
+            break;
+        }
+
+        if ((conf_fd = acceptConnection(&client_addr, ready_fd)) == FAIL)
+        {
+            continue;
+        }
+
+        if ((slot = admitConnection(conf_fd)) == FAIL)
+        {
+            continue;
+        }
+
+        t_params[slot].client_addr = client_addr;
+        if (createThread(&threads[slot], (void*)aesdsocket_task, (void*)&t_params[slot], &worker_placement) == FALSE)
+        {
+            /* Out of threads, shed the connection and give the slot back */
+            admission.rejected_connections++;
+            close(conf_fd);
+            releaseMemory(DATA_BLOCK_SIZE);
+            __atomic_sub_fetch(&active_connections, 1, __ATOMIC_RELAXED);
+            t_params[slot].joinable = FALSE;
+            t_params[slot].active = FALSE;
+        }
     }
 
+    syslog(LOG_INFO, "Caught signal, exiting");
     teardown();
+
+    /* Final dump once every thread is joined and the counters are settled */
+    printStats();
+    free(per_cpu_stats);
     return 0;
 }
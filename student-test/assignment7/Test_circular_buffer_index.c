@@ -0,0 +1,211 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+/**
+* Exercises the indexed lookups of aesd-circular-buffer.c: the binary search of
+* aesd_circular_buffer_find_entry_offset_for_fpos(), the logical index lookup of
+* aesd_buffer_find_offset() and aesd_circular_buffer_resize() / remove_oldest().
+* Entries point at string literals, nothing needs freeing but the entry array.
+*/
+
+static void add_string(struct aesd_circular_buffer *buffer, const char *string,
+                       Boolean complete_entry, Boolean new_entry)
+{
+    struct aesd_buffer_entry entry;
+
+    memset(&entry, 0, sizeof(entry));
+    entry.buffptr = string;
+    entry.size = strlen(string);
+    entry.capacity = entry.size;
+    aesd_circular_buffer_add_entry(buffer, &entry, complete_entry, new_entry);
+}
+
+static void verify_fpos(struct aesd_circular_buffer *buffer, size_t char_offset,
+                        const char *expected_entry, size_t expected_offset)
+{
+    struct aesd_buffer_entry *entry;
+    size_t offset_rtn = (size_t)-1;
+
+    entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, char_offset, &offset_rtn);
+    TEST_ASSERT_NOT_NULL_MESSAGE(entry, "No entry found for an offset inside the buffer");
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(expected_entry, entry->buffptr, "Offset resolved to the wrong entry");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(expected_offset, offset_rtn, "Wrong byte offset within the entry");
+}
+
+static void verify_fpos_missing(struct aesd_circular_buffer *buffer, size_t char_offset)
+{
+    size_t offset_rtn = 0;
+
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_find_entry_offset_for_fpos(buffer, char_offset, &offset_rtn),
+                             "Found an entry for an offset past the end of the buffer");
+}
+
+/**
+* Six entries through a four entry ring, so out_offs has wrapped and the held
+* entries no longer start at stream position 0
+*/
+void test_circular_buffer_lookup_across_wraparound()
+{
+    struct aesd_circular_buffer buffer;
+    const char *strings[] = { "aa\n", "bbb\n", "c\n", "dddd\n", "e\n", "ff\n" };
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init(&buffer, 4));
+    for (unsigned int i = 0; i < 6; i++)
+    {
+        add_string(&buffer, strings[i], TRUE, TRUE);
+    }
+
+    TEST_ASSERT_TRUE(buffer.full);
+    TEST_ASSERT_EQUAL_UINT32(2, buffer.out_offs);
+    TEST_ASSERT_EQUAL_UINT32(4, aesd_circular_buffer_count(&buffer));
+    TEST_ASSERT_EQUAL_UINT32(7, buffer.base_pos);
+
+    verify_fpos(&buffer, 0, strings[2], 0);
+    verify_fpos(&buffer, 1, strings[2], 1);
+    verify_fpos(&buffer, 2, strings[3], 0);
+    verify_fpos(&buffer, 6, strings[3], 4);
+    verify_fpos(&buffer, 7, strings[4], 0);
+    verify_fpos(&buffer, 9, strings[5], 0);
+    verify_fpos(&buffer, 11, strings[5], 2);
+    verify_fpos_missing(&buffer, 12);
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_buffer_find_offset(&buffer, 0, 0));
+    TEST_ASSERT_EQUAL_INT(4, aesd_buffer_find_offset(&buffer, 1, 2));
+    TEST_ASSERT_EQUAL_INT(10, aesd_buffer_find_offset(&buffer, 3, 1));
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-1, aesd_buffer_find_offset(&buffer, 4, 0), "Entry past the newest one accepted");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-1, aesd_buffer_find_offset(&buffer, 1, 5), "Offset past the entry accepted");
+
+    aesd_circular_buffer_destroy(&buffer);
+}
+
+/**
+* A write without a newline sits at in_offs as a partial entry. It is found by
+* both lookups but not counted as complete until it is finished.
+*/
+void test_circular_buffer_partial_entry_at_in_offs()
+{
+    struct aesd_circular_buffer buffer;
+    const char *complete = "ab\n";
+    const char *partial = "cd";
+    const char *finished = "cdef\n";
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init(&buffer, 4));
+    add_string(&buffer, complete, TRUE, TRUE);
+    add_string(&buffer, partial, FALSE, TRUE);
+
+    TEST_ASSERT_EQUAL_UINT32(1, buffer.in_offs);
+    TEST_ASSERT_EQUAL_UINT32(1, aesd_circular_buffer_count(&buffer));
+    TEST_ASSERT_EQUAL_UINT32(2, aesd_circular_buffer_used(&buffer));
+    verify_fpos(&buffer, 2, complete, 2);
+    verify_fpos(&buffer, 3, partial, 0);
+    verify_fpos(&buffer, 4, partial, 1);
+    verify_fpos_missing(&buffer, 5);
+    TEST_ASSERT_EQUAL_INT(4, aesd_buffer_find_offset(&buffer, 1, 1));
+    TEST_ASSERT_EQUAL_INT(-1, aesd_buffer_find_offset(&buffer, 1, 2));
+
+    /* Growing the partial entry keeps its start and sequence number */
+    add_string(&buffer, finished, TRUE, FALSE);
+    TEST_ASSERT_EQUAL_UINT32(2, aesd_circular_buffer_count(&buffer));
+    TEST_ASSERT_EQUAL_UINT32(3, buffer.entry[1].start);
+    TEST_ASSERT_EQUAL_UINT32(1, (uint32_t)buffer.entry[1].seq);
+    TEST_ASSERT_EQUAL_UINT32(2, (uint32_t)buffer.end_seq);
+    verify_fpos(&buffer, 7, finished, 4);
+    verify_fpos_missing(&buffer, 8);
+
+    aesd_circular_buffer_destroy(&buffer);
+}
+
+/**
+* end_pos - base_pos is one past the last byte held, it must not resolve to an
+* entry, neither from the start of the stream nor once entries were dropped
+*/
+void test_circular_buffer_offset_at_end_pos()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry removed;
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init(&buffer, 2));
+    verify_fpos_missing(&buffer, 0);
+
+    add_string(&buffer, "one\n", TRUE, TRUE);
+    verify_fpos_missing(&buffer, buffer.end_pos - buffer.base_pos);
+
+    add_string(&buffer, "two\n", TRUE, TRUE);
+    add_string(&buffer, "three\n", TRUE, TRUE);
+    TEST_ASSERT_EQUAL_UINT32(4, buffer.base_pos);
+    TEST_ASSERT_EQUAL_UINT32(10, buffer.end_pos - buffer.base_pos);
+    verify_fpos(&buffer, 9, "three\n", 5);
+    verify_fpos_missing(&buffer, buffer.end_pos - buffer.base_pos);
+
+    TEST_ASSERT_TRUE(aesd_circular_buffer_remove_oldest(&buffer, &removed));
+    TEST_ASSERT_EQUAL_UINT32(8, buffer.base_pos);
+    verify_fpos(&buffer, 0, "three\n", 0);
+    verify_fpos_missing(&buffer, buffer.end_pos - buffer.base_pos);
+
+    TEST_ASSERT_TRUE(aesd_circular_buffer_remove_oldest(&buffer, &removed));
+    TEST_ASSERT_FALSE(aesd_circular_buffer_remove_oldest(&buffer, &removed));
+    TEST_ASSERT_EQUAL_UINT32(buffer.end_pos, buffer.base_pos);
+    verify_fpos_missing(&buffer, 0);
+
+    aesd_circular_buffer_destroy(&buffer);
+}
+
+/**
+* Resizing a wrapped ring holding a partial entry moves the entries oldest
+* first to slot 0 and keeps the partial entry at in_offs, both when shrinking
+* and when growing
+*/
+void test_circular_buffer_resize_with_partial_entry()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry removed;
+    const char *strings[] = { "e0\n", "e1\n", "e2\n", "e3\n", "e4\n" };
+    const char *partial = "pp";
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init(&buffer, 4));
+    for (unsigned int i = 0; i < 5; i++)
+    {
+        add_string(&buffer, strings[i], TRUE, TRUE);
+    }
+
+    /* Make room for the partial entry the way the driver does */
+    TEST_ASSERT_TRUE(aesd_circular_buffer_remove_oldest(&buffer, &removed));
+    TEST_ASSERT_EQUAL_PTR(strings[1], removed.buffptr);
+    add_string(&buffer, partial, FALSE, TRUE);
+    TEST_ASSERT_EQUAL_UINT32(4, aesd_circular_buffer_used(&buffer));
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EINVAL, aesd_circular_buffer_resize(&buffer, 3), "Shrunk below the entries held");
+
+    TEST_ASSERT_TRUE(aesd_circular_buffer_remove_oldest(&buffer, &removed));
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_resize(&buffer, 3));
+    TEST_ASSERT_EQUAL_UINT32(3, buffer.capacity);
+    TEST_ASSERT_EQUAL_UINT32(0, buffer.out_offs);
+    TEST_ASSERT_EQUAL_UINT32(2, buffer.in_offs);
+    TEST_ASSERT_FALSE(buffer.full);
+    TEST_ASSERT_EQUAL_UINT32(2, aesd_circular_buffer_count(&buffer));
+    TEST_ASSERT_EQUAL_UINT32(3, aesd_circular_buffer_used(&buffer));
+    verify_fpos(&buffer, 0, strings[3], 0);
+    verify_fpos(&buffer, 5, strings[4], 2);
+    verify_fpos(&buffer, 7, partial, 1);
+    verify_fpos_missing(&buffer, 8);
+    TEST_ASSERT_EQUAL_INT(6, aesd_buffer_find_offset(&buffer, 2, 0));
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_resize(&buffer, 8));
+    TEST_ASSERT_EQUAL_UINT32(8, buffer.capacity);
+    TEST_ASSERT_EQUAL_UINT32(2, buffer.in_offs);
+    TEST_ASSERT_EQUAL_PTR(partial, buffer.entry[buffer.in_offs].buffptr);
+    verify_fpos(&buffer, 3, strings[4], 0);
+    verify_fpos(&buffer, 7, partial, 1);
+    verify_fpos_missing(&buffer, 8);
+
+    /* Finishing the partial entry after the resize completes it in place */
+    add_string(&buffer, "ppq\n", TRUE, FALSE);
+    TEST_ASSERT_EQUAL_UINT32(3, aesd_circular_buffer_count(&buffer));
+    TEST_ASSERT_EQUAL_UINT32(3, buffer.in_offs);
+    verify_fpos(&buffer, 9, "ppq\n", 3);
+    verify_fpos_missing(&buffer, 10);
+
+    aesd_circular_buffer_destroy(&buffer);
+}